@@ -0,0 +1,102 @@
+// IQ decimation throughput: a HalfbandDecimator against a ComplexDecimator
+// (the general polyphase path) with the same taps, then AudioProcessor with
+// each front end at the sample rates that divide into 48 kHz audio.
+//
+// Usage: decimation [seconds of IQ at each rate]
+
+#include "AudioProcessor.hpp"
+#include "FirDecimator.hpp"
+#include "HalfbandDecimator.hpp"
+#include <algorithm>
+#include <chrono>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <vector>
+
+using clock_type = std::chrono::steady_clock;
+
+static double seconds_since(clock_type::time_point start) {
+  return std::chrono::duration<double>(clock_type::now() - start).count();
+}
+
+// Best of a few runs, the others are the machine doing something else
+static const int RUNS = 3;
+
+// Runs a decimator over iq in blocks like AudioProcessor does, returns Msps
+template <typename Decimator>
+static double run(Decimator &decimator,
+                  const std::vector<std::complex<float>> &iq,
+                  std::size_t block) {
+  double best = 0.0;
+  float sink = 0.0f;
+  for (int i = 0; i < RUNS; i++) {
+    auto start = clock_type::now();
+    for (std::size_t done = 0; done + block <= iq.size(); done += block) {
+      std::size_t n = decimator.process(iq.data() + done, block);
+      sink += decimator.output()[n - 1].real();
+    }
+    best = std::max(best, iq.size() / seconds_since(start) / 1e6);
+  }
+  // Keeps the work from being optimized away
+  return sink == 12345.0f ? 0.0 : best;
+}
+
+int main(int argc, char *argv[]) {
+  double seconds = argc > 1 ? std::atof(argv[1]) : 1.0;
+  const std::size_t block = 2048;
+
+  std::mt19937 rng(1);
+  std::vector<uint8_t> raw(2 * static_cast<std::size_t>(seconds * 3072000));
+  for (uint8_t &b : raw) {
+    b = static_cast<uint8_t>(rng());
+  }
+  std::vector<std::complex<float>> iq(raw.size() / 2);
+  iq_to_float(raw.data(), iq.size(), reinterpret_cast<float *>(iq.data()));
+
+  // The stages of the 3.072 Msps chain, widest transition band first
+  std::printf("%s, %zu lanes\n", simd::NAME, simd::WIDTH);
+  std::printf("%8s %14s %14s %8s\n", "taps", "halfband", "polyphase",
+              "speedup");
+  for (double passband : {80.0 / 3072, 80.0 / 768, 80.0 / 384}) {
+    std::vector<float> taps = design_halfband(passband);
+    HalfbandDecimator halfband(taps, block);
+    ComplexDecimator polyphase(2, taps, block);
+    double hb = run(halfband, iq, block);
+    double fir = run(polyphase, iq, block);
+    std::printf("%8zu %9.1f Msps %9.1f Msps %7.1fx\n", taps.size(), hb, fir,
+                hb / fir);
+  }
+
+  std::printf("\n%6s %10s %12s  %s\n", "Msps", "front end", "throughput",
+              "chain");
+  struct {
+    const char *name;
+    AudioProcessor::FrontEnd front_end;
+  } front_ends[] = {{"fir", AudioProcessor::FrontEnd::FIR},
+                    {"cic", AudioProcessor::FrontEnd::CIC},
+                    {"halfband", AudioProcessor::FrontEnd::HALFBAND}};
+  for (int decimation : {20, 24, 32, 40, 50, 60, 64}) {
+    std::size_t len = 2 * static_cast<std::size_t>(
+                              seconds * decimation * TARGET_AUDIO_RATE);
+    for (const auto &f : front_ends) {
+      AudioProcessor AP(decimation);
+      AP.set_front_end(f.front_end);
+      double msps = 0.0;
+      for (int i = 0; i < RUNS; i++) {
+        std::vector<int16_t> audio;
+        audio.reserve(len / (2 * decimation) + 1);
+        auto start = clock_type::now();
+        AP.process(raw.data(), len, audio);
+        msps = std::max(msps, len / 2 / seconds_since(start) / 1e6);
+      }
+      std::printf("%6.3f %10s %7.1f Msps  %s\n",
+                  decimation * TARGET_AUDIO_RATE / 1e6, f.name, msps,
+                  AP.describe().c_str());
+    }
+  }
+  return 0;
+}
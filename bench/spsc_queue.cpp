@@ -0,0 +1,123 @@
+// Cross-core SPSCQueue throughput. A producer and a consumer thread, pinned
+// to two cores, move bytes through one queue for a fixed time per message
+// size, with push/pop and with reserve/commit and peek/consume. Both ways
+// copy every message in and out. Each runs once with the cached indices and
+// once with an index re-read on every call. Small messages mostly measure
+// the index traffic between the cores, large ones the memcpy.
+//
+// Usage: spsc_queue [producer core] [consumer core]
+
+#include "SPSCQueue.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <thread>
+#include <vector>
+
+static void pin(int core) {
+  if (core < 0) {
+    return;
+  }
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(core, &cpus);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+    std::fprintf(stderr, "Warning: Failed to pin to core %d\n", core);
+  }
+}
+
+// Returns bytes per second
+template <bool CACHE_INDICES>
+static double run(std::size_t message_size, int producer_core,
+                  int consumer_core, bool zero_copy) {
+  using Queue = SPSCQueue<uint8_t, CACHE_INDICES>;
+  using clock = std::chrono::steady_clock;
+  const auto duration = std::chrono::milliseconds(500);
+
+  // Same size as the receiver's queues
+  Queue queue(1 << 20, true);
+  queue.set_wait_strategy(WaitStrategy::SPIN_YIELD);
+  std::atomic<bool> done{false};
+  std::atomic<bool> go{false};
+
+  std::thread producer([&] {
+    pin(producer_core);
+    std::vector<uint8_t> message(message_size, 0x55);
+    while (!go) {
+    }
+    while (!done.load(std::memory_order_relaxed)) {
+      if (zero_copy) {
+        typename Queue::WriteRegion region = queue.reserve(message_size);
+        if (region.size() == message_size) {
+          // Same bytes as push() moves, in one run on a mirrored queue
+          std::memcpy(region.first, message.data(), region.first_len);
+          std::memcpy(region.second, message.data() + region.first_len,
+                      region.second_len);
+          queue.commit(message_size);
+        }
+      } else {
+        queue.push(message.data(), message_size);
+      }
+    }
+  });
+
+  pin(consumer_core);
+  std::vector<uint8_t> dest(message_size);
+  std::size_t total = 0;
+
+  go = true;
+  auto start = clock::now();
+  auto end = start + duration;
+  // Checking the clock is slow next to a 64 byte pop
+  for (std::size_t i = 0;; i++) {
+    if ((i & 1023) == 0 && clock::now() >= end) {
+      break;
+    }
+    if (zero_copy) {
+      typename Queue::ReadRegion region = queue.peek(message_size);
+      std::memcpy(dest.data(), region.first, region.first_len);
+      std::memcpy(dest.data() + region.first_len, region.second,
+                  region.second_len);
+      total += region.size();
+      queue.consume(region.size());
+    } else {
+      total += queue.pop(dest.data(), message_size);
+    }
+  }
+  double seconds =
+      std::chrono::duration<double>(clock::now() - start).count();
+
+  done = true;
+  producer.join();
+  return total / seconds;
+}
+
+int main(int argc, char *argv[]) {
+  int producer_core = argc > 1 ? std::atoi(argv[1]) : 0;
+  int consumer_core = argc > 2 ? std::atoi(argv[2]) : 1;
+
+  std::printf("producer on core %d, consumer on core %d, MB/s\n",
+              producer_core, consumer_core);
+  std::printf("%10s %23s %23s\n", "", "push/pop", "zero-copy");
+  std::printf("%10s %11s %11s %11s %11s\n", "message", "uncached",
+              "cached", "uncached", "cached");
+
+  for (std::size_t size : {64, 512, 4096, 16384, 262144}) {
+    double copy_uncached = run<false>(size, producer_core, consumer_core,
+                                      false);
+    double copy_cached = run<true>(size, producer_core, consumer_core, false);
+    double zero_uncached = run<false>(size, producer_core, consumer_core,
+                                      true);
+    double zero_cached = run<true>(size, producer_core, consumer_core, true);
+    std::printf("%10zu %11.0f %11.0f %11.0f %11.0f\n", size,
+                copy_uncached / 1e6, copy_cached / 1e6, zero_uncached / 1e6,
+                zero_cached / 1e6);
+  }
+  return 0;
+}
@@ -0,0 +1,390 @@
+#pragma once
+
+#include "CicDecimator.hpp"
+#include "FirDecimator.hpp"
+#include "FmDiscriminator.hpp"
+#include "HalfbandDecimator.hpp"
+#include "Simd.hpp"
+#include "StreamBuffer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+static constexpr int TARGET_AUDIO_RATE = 48000;
+
+// Converts n raw uint8_t IQ pairs to floats in -1..1:
+// https://k3xec.com/packrat-processing-iq/
+inline void iq_to_float(const uint8_t *raw_iq, std::size_t n, float *out) {
+  const float scale = 1.0f / 127.5f;
+  std::size_t i = 0;
+  for (; i + simd::WIDTH <= 2 * n; i += simd::WIDTH) {
+    simd::Floats x = simd::load_u8(raw_iq + i);
+    simd::store(out + i, (x - simd::broadcast(127.5f)) *
+                             simd::broadcast(scale));
+  }
+  for (; i < 2 * n; i++) {
+    out[i] = (static_cast<float>(raw_iq[i]) - 127.5f) * scale;
+  }
+}
+
+// Raw IQ to audio: the IQ is decimated to an intermediate rate (IF) of
+// about 192-240 kHz that still holds the whole FM channel, demodulated there
+// and decimated again to the audio rate, all with FIR decimators designed
+// for the rates at hand. Filtering before the discriminator keeps
+// neighbouring stations from aliasing into the audio, and the discriminator
+// only runs at the IF rate.
+//
+// With the CIC front end the bulk of the IF decimation is done by a
+// CicDecimator straight on the raw bytes, in integers, and a single FIR that
+// also compensates the CIC's droop does the rest and selects the channel.
+// That's cheaper on CPUs with weak floating point or no SIMD, the FIR chain
+// is the cleaner filter. The halfband front end does the power of two part
+// of the IF decimation in HalfbandDecimator stages, after FIR stages for the
+// rest. That pays off where they replace long FIR stages (1.152 to
+// 1.92 Msps), a cascade of short ones at 3.072 Msps is slower than FIR.
+class AudioProcessor {
+public:
+  enum class FrontEnd { FIR, CIC, HALFBAND };
+
+  AudioProcessor(int decimation_rate)
+      : previous_filtered_sample(0.0f), iq_buffer(CHUNK),
+        phase_buffer(CHUNK) {
+
+    // Calculations of alpha based on:
+    // https://en.wikipedia.org/wiki/Low-pass_filter#Discrete-time_realization
+    // Which links to:
+    // https://en.wikipedia.org/wiki/Exponential_smoothing#Time_constant
+    // Giving us the formula used below.
+    // 50 micro seconds is the default time-constant in Europe:
+    // https://www.fmradiobroadcast.com/article/detail/fm-emphasis.html
+    const float time_constant = 50e-6f;
+    float dt = 1.0f / TARGET_AUDIO_RATE;
+    alpha = 1.0f - std::exp(-dt / time_constant);
+
+    prepare(decimation_rate);
+  }
+
+  // Designs the chain for another decimation rate ahead of time, so a
+  // reset() to it doesn't design filters or allocate. That's what the audio
+  // callback needs, prepare every rate it can see before it starts.
+  void prepare(int rate) {
+    if (find(rate) == chains.size()) {
+      chains.push_back(plan(rate));
+    }
+  }
+
+  // Forgets the filter state after a retune, so the phase jump to the new
+  // station doesn't come out as a click, and switches to the chain for
+  // new_decimation_rate. One that wasn't prepared is planned here.
+  void reset(int new_decimation_rate) {
+    prepare(new_decimation_rate);
+    current = find(new_decimation_rate);
+    Chain &c = chains[current];
+    if (c.cic) {
+      c.cic->reset();
+    }
+    for (ComplexDecimator &stage : c.if_stages) {
+      stage.reset();
+    }
+    for (HalfbandDecimator &stage : c.halfband_stages) {
+      stage.reset();
+    }
+    discriminator.reset();
+    c.audio_stage->reset();
+    previous_filtered_sample = 0.0f;
+  }
+
+  int decimation() const { return chains[current].decimation_rate; }
+
+  // Rate the discriminator runs at. A decimation without a small factor
+  // for the audio stage leaves it well above MIN_IF_RATE, all the way up
+  // to the input rate with no IF stage (and no channel filter) when the
+  // decimation is prime, e.g. 41 at 1.968 Msps.
+  int if_rate() const {
+    return chains[current].audio_factor * TARGET_AUDIO_RATE;
+  }
+
+  // The decimation chain, e.g. "FIR 5 (33 taps) > FIR 2 (45 taps) > FM >
+  // FIR 4 (175 taps)" at 1.92 Msps
+  std::string describe() const {
+    const Chain &c = chains[current];
+    std::string text;
+    if (c.cic) {
+      text += "CIC " + std::to_string(c.cic->decimation()) + " (" +
+              std::to_string(c.cic->order()) + " stages) > ";
+    }
+    for (const ComplexDecimator &stage : c.if_stages) {
+      text += "FIR " + std::to_string(stage.decimation()) + " (" +
+              std::to_string(stage.taps()) + " taps) > ";
+    }
+    for (const HalfbandDecimator &stage : c.halfband_stages) {
+      text += "HB 2 (" + std::to_string(stage.taps()) + " taps) > ";
+    }
+    return text + "FM > FIR " + std::to_string(c.audio_stage->decimation()) +
+           " (" + std::to_string(c.audio_stage->taps()) + " taps)";
+  }
+
+  // FAST (SIMD, polynomial atan2) by default, EXACT for std::atan2
+  void set_discriminator(FmDiscriminator::Mode mode) {
+    discriminator.set_mode(mode);
+  }
+
+  // FIR by default. CIC needs an IF decimation that isn't prime, so the
+  // compensation FIR can decimate too, and falls back to FIR otherwise.
+  // HALFBAND is the FIR chain when the IF decimation is odd.
+  // Re-plans every prepared rate.
+  void set_front_end(FrontEnd new_front_end) {
+    front_end = new_front_end;
+    for (Chain &c : chains) {
+      c = plan(c.decimation_rate);
+    }
+  }
+
+  std::vector<int16_t> process(const std::vector<uint8_t> &raw_iq) {
+    std::vector<int16_t> output_buffer;
+    process(raw_iq.data(), raw_iq.size(), output_buffer);
+    return output_buffer;
+  }
+
+  // Demodulates len bytes of raw IQ and appends the audio to output_buffer.
+  // Works on any memory, e.g. straight out of a queue with
+  // BroadcastRing::peek(), and keeps its state across calls so a block can be
+  // fed in pieces.
+  void process(const uint8_t *raw_iq, std::size_t len,
+               std::vector<int16_t> &output_buffer) {
+    // IQ sampling gives us the factor 2.
+    // Every decimation_rate samples become 1
+    // Hence our output buffer is smaller than the input buffer by a factor of
+    // (2 * decimation_rate)
+    Chain &c = chains[current];
+    output_buffer.reserve(output_buffer.size() +
+                          len / (2 * c.decimation_rate));
+
+    // In chunks that fit the scratch buffers, every stage keeps its state
+    // for the next one
+    for (size_t done = 0; done + 2 <= len; done += 2 * CHUNK) {
+      size_t n = std::min((len - done) / 2, CHUNK);
+      const std::complex<float> *iq = iq_buffer.data();
+      if (c.cic) {
+        n = c.cic->process(raw_iq + done, n);
+        iq = c.cic->output();
+      } else {
+        // std::complex<float> arrays are interleaved floats
+        iq_to_float(raw_iq + done, n,
+                    reinterpret_cast<float *>(iq_buffer.data()));
+      }
+
+      for (ComplexDecimator &stage : c.if_stages) {
+        n = stage.process(iq, n);
+        iq = stage.output();
+      }
+      for (HalfbandDecimator &stage : c.halfband_stages) {
+        n = stage.process(iq, n);
+        iq = stage.output();
+      }
+
+      discriminator.process(reinterpret_cast<const float *>(iq), n,
+                            phase_buffer.data());
+      n = c.audio_stage->process(phase_buffer.data(), n);
+      emit(c.audio_stage->output(), c.level, n, output_buffer);
+    }
+  }
+
+private:
+  // The filters for one decimation rate
+  struct Chain {
+    int decimation_rate;
+    // Of decimation_rate, decimation_rate / audio_factor happens at IF
+    int audio_factor;
+    // Only with the CIC front end
+    std::unique_ptr<CicDecimator> cic;
+    std::vector<ComplexDecimator> if_stages;
+    // After if_stages, only with the halfband front end
+    std::vector<HalfbandDecimator> halfband_stages;
+    std::unique_ptr<RealDecimator> audio_stage;
+    float level;
+  };
+
+  // Index of rate's chain, chains.size() if there is none. Doesn't allocate.
+  std::size_t find(int rate) const {
+    std::size_t i = 0;
+    while (i < chains.size() && chains[i].decimation_rate != rate) {
+      i++;
+    }
+    return i;
+  }
+
+  // Splits decimation_rate into IF stages and the audio decimation, and
+  // designs their filters. The audio factor is the smallest divisor of
+  // decimation_rate that leaves the IF at MIN_IF_RATE or more; what's left
+  // is decimated in stages of at most MAX_STAGE_FACTOR, largest first, since
+  // the first stage runs at the full rate and can have the widest
+  // transition band. With the CIC front end the compensation FIR takes the
+  // smallest prime factor and the CIC the rest: the CIC's output rate has to
+  // be well above the channel for it to stop what folds into the channel.
+  // With the halfband front end the factors of 2 are halfband stages at the
+  // end of the chain.
+  Chain plan(int rate) const {
+    Chain c;
+    c.decimation_rate = rate;
+    c.audio_factor = rate;
+    for (int f = MIN_IF_RATE / TARGET_AUDIO_RATE; f < rate; f++) {
+      if (rate % f == 0) {
+        c.audio_factor = f;
+        break;
+      }
+    }
+
+    double in_rate = static_cast<double>(rate) * TARGET_AUDIO_RATE;
+    std::size_t block = CHUNK;
+    int left = rate / c.audio_factor;
+    int smallest = left;
+    for (int p = 2; p < left; p++) {
+      if (left % p == 0) {
+        smallest = p;
+        break;
+      }
+    }
+    if (front_end == FrontEnd::CIC && smallest < left) {
+      c.cic =
+          std::make_unique<CicDecimator>(left / smallest, CIC_STAGES, block);
+      in_rate /= c.cic->decimation();
+      block = block / c.cic->decimation() + 1;
+      left = smallest;
+    }
+    int halfbands = 0;
+    while (front_end == FrontEnd::HALFBAND && left % 2 == 0) {
+      left /= 2;
+      halfbands++;
+    }
+    // A halfband stops from its output rate minus the channel on and no
+    // earlier, so as the last stage it only selects the channel at a
+    // 192 kHz IF. Above that a FIR does.
+    double if_rate = static_cast<double>(c.audio_factor) * TARGET_AUDIO_RATE;
+    if (halfbands > 0 && if_rate - CHANNEL_HALF_WIDTH > CHANNEL_STOPBAND) {
+      left *= 2;
+      halfbands--;
+    }
+
+    // Prime factors of the IF decimation, largest first, merged as long as
+    // a stage stays small
+    std::vector<int> factors;
+    for (int p = left; p > 1; p--) {
+      while (left % p == 0 && is_prime(p)) {
+        if (!factors.empty() && factors.back() * p <= MAX_STAGE_FACTOR) {
+          factors.back() *= p;
+        } else {
+          factors.push_back(p);
+        }
+        left /= p;
+      }
+    }
+
+    // Each stage passes the channel and stops everything that would fold
+    // back into it at its output rate. The last one also selects the
+    // channel, the next station is 200 kHz away.
+    for (size_t i = 0; i < factors.size(); i++) {
+      int factor = factors[i];
+      double out_rate = in_rate / factor;
+      double stopband = out_rate - CHANNEL_HALF_WIDTH;
+      if (i + 1 == factors.size() && halfbands == 0) {
+        stopband = std::min(stopband, CHANNEL_STOPBAND);
+      }
+      LowpassSpec spec{CHANNEL_HALF_WIDTH / in_rate, stopband / in_rate};
+      if (c.cic) {
+        c.if_stages.emplace_back(
+            factor,
+            design_cic_compensator(spec, c.cic->decimation(), c.cic->order()),
+            block);
+      } else {
+        c.if_stages.emplace_back(factor, design_lowpass(spec), block);
+      }
+      block = block / factor + 1;
+      in_rate = out_rate;
+    }
+
+    for (int i = 0; i < halfbands; i++) {
+      c.halfband_stages.emplace_back(
+          design_halfband(CHANNEL_HALF_WIDTH / in_rate), block);
+      block = block / 2 + 1;
+      in_rate /= 2;
+    }
+
+    // Mono audio only: the 19 kHz stereo pilot and everything above it goes
+    LowpassSpec spec{AUDIO_PASSBAND / in_rate, AUDIO_STOPBAND / in_rate};
+    c.audio_stage = std::make_unique<RealDecimator>(
+        c.audio_factor, design_lowpass(spec), block);
+
+    // Phase steps at the IF rate are larger than at the input rate by the
+    // IF decimation, undoing that keeps the audio level independent of how
+    // the decimation is split
+    c.level = static_cast<float>(c.audio_factor) / rate;
+    return c;
+  }
+
+  static bool is_prime(int n) {
+    for (int d = 2; d * d <= n; d++) {
+      if (n % d == 0) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  // Demodulated audio rate samples to int16
+  void emit(const float *audio, float level, std::size_t n,
+            std::vector<int16_t> &output_buffer) {
+    for (size_t i = 0; i < n; i++) {
+      float audio_sample = audio[i] * level;
+
+      // de-emphasis like in below:
+      // rtl_fm.c: void deemph_filter(struct demod_state *fm)
+      float filtered_sample = (alpha * audio_sample) +
+                              ((1.0f - alpha) * previous_filtered_sample);
+      previous_filtered_sample = filtered_sample;
+
+      // Amplify the filtered audio sample
+      float amplified_sample = filtered_sample * 16000.0f;
+      // Clamp values to prevent integer overflow when casting to int16
+      amplified_sample = std::clamp(amplified_sample, -32768.0f, 32767.0f);
+
+      // Append to our output buffer
+      output_buffer.push_back(static_cast<int16_t>(amplified_sample));
+    }
+  }
+
+  // IQ pairs per chunk
+  static constexpr std::size_t CHUNK = 2048;
+  // Lowest IF rate, wide enough for the FM channel
+  static constexpr int MIN_IF_RATE = 192000;
+  // Half the bandwidth the IF stages pass, +-75 kHz deviation plus some of
+  // the modulation
+  static constexpr double CHANNEL_HALF_WIDTH = 80000.0;
+  // Where the IF stages stop at the latest
+  static constexpr double CHANNEL_STOPBAND = 120000.0;
+  static constexpr int MAX_STAGE_FACTOR = 8;
+  // About 60 dB on what folds into the channel with a compensation
+  // FIR decimating by 2
+  static constexpr int CIC_STAGES = 5;
+  // Audio band kept, and where the stereo pilot starts
+  static constexpr double AUDIO_PASSBAND = 15000.0;
+  static constexpr double AUDIO_STOPBAND = 19000.0;
+
+  FrontEnd front_end = FrontEnd::FIR;
+  // One per prepared rate, current is the one in use
+  std::vector<Chain> chains;
+  std::size_t current = 0;
+  FmDiscriminator discriminator;
+  // Previous De-emphasised sample
+  float previous_filtered_sample;
+  // constant for de-emphasis in europe
+  float alpha;
+  // Scratch for one chunk
+  StreamArray<std::complex<float>> iq_buffer;
+  StreamArray<float> phase_buffer;
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include "IQSource.hpp"
+#include "StreamBuffer.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+
+// A filled pool block on its way to a consumer. Trivially copyable, so it
+// travels through an SPSCQueue like any other element. Every copy a
+// consumer holds counts as one reference, handed back with
+// BlockPool::release() once it is done with data.
+struct BlockRef {
+  const uint8_t *data;
+  // Bytes, always whole IQ pairs
+  std::size_t len;
+  // Of the block's first sample, see IQBlock
+  uint64_t sequence;
+  uint64_t first_sample;
+  std::chrono::steady_clock::time_point timestamp;
+  // Center frequency the samples were taken at
+  int frequency;
+  std::atomic<uint32_t> *refs;
+
+  std::size_t samples() const { return len / 2; }
+};
+static_assert(std::is_trivially_copyable<BlockRef>::value,
+              "BlockRef has to fit through an SPSCQueue");
+
+// A fixed set of IQ blocks, allocated once, that the producer fills once and
+// hands to any number of consumers by descriptor, so adding a consumer costs
+// a queue push instead of a copy of the stream. A block is free again when
+// its last reference is released.
+//
+// Only the producer acquires, so finding a free block is a scan over the
+// reference counts starting after the last block handed out. Consumers
+// release in roughly the order they got the blocks, which keeps that scan
+// at a step or two.
+class BlockPool {
+public:
+  BlockPool(std::size_t count, std::size_t block_size = IQSource::BLOCK_SIZE)
+      : num_blocks(count), block_bytes(block_size),
+        memory(count * block_size), counters(new Counter[count]) {
+    if (count == 0 || block_size % BLOCK_ALIGN != 0) {
+      throw std::invalid_argument(
+          "BlockPool needs blocks that are a multiple of the page size");
+    }
+  }
+
+  BlockPool(const BlockPool &) = delete;
+  BlockPool &operator=(const BlockPool &) = delete;
+
+  // Producer only: memory of a free block to fill (block_size() bytes), or
+  // nullptr if every block is still referenced. Pass what was written to
+  // publish() before acquiring the next one.
+  uint8_t *acquire() {
+    for (std::size_t i = 0; i < num_blocks; i++) {
+      std::size_t index = next + i < num_blocks ? next + i
+                                                : next + i - num_blocks;
+      // Pairs with release(), the last consumer is done reading
+      if (counters[index].refs.load(std::memory_order_acquire) == 0) {
+        claimed = index;
+        next = index + 1 == num_blocks ? 0 : index + 1;
+        return block_data(index);
+      }
+    }
+    return nullptr;
+  }
+
+  // Producer only: turns the acquired block into a descriptor. info has
+  // the length and metadata, data and refs are filled in here. consumers is
+  // the number of references to start with, one per queue the descriptor
+  // is pushed to; whoever fails to push one releases it.
+  BlockRef publish(BlockRef info, uint32_t consumers) {
+    info.data = block_data(claimed);
+    info.refs = &counters[claimed].refs;
+    // The queue push that hands it out is the release
+    info.refs->store(consumers, std::memory_order_relaxed);
+    return info;
+  }
+
+  // Adds n references, for a consumer that shares a block further (the
+  // rtl_tcp server queues it once per client)
+  static void retain(const BlockRef &block, uint32_t n = 1) {
+    block.refs->fetch_add(n, std::memory_order_relaxed);
+  }
+
+  static void release(const BlockRef &block) {
+    block.refs->fetch_sub(1, std::memory_order_release);
+  }
+
+  std::size_t block_size() const { return block_bytes; }
+  std::size_t count() const { return num_blocks; }
+
+private:
+  // One line each, consumers releasing neighbouring blocks don't contend
+  struct alignas(64) Counter {
+    std::atomic<uint32_t> refs{0};
+  };
+
+  uint8_t *block_data(std::size_t index) const {
+    return memory.data() + index * block_bytes;
+  }
+
+  // Whole pages, so blocks can go straight to O_DIRECT or a socket
+  static constexpr std::size_t BLOCK_ALIGN = 4096;
+
+  std::size_t num_blocks;
+  std::size_t block_bytes;
+  StreamBuffer memory;
+  std::unique_ptr<Counter[]> counters;
+  // Producer only
+  std::size_t next = 0;
+  std::size_t claimed = 0;
+};
@@ -0,0 +1,363 @@
+#pragma once
+
+#include "MirroredBuffer.hpp"
+#include "QueueTelemetry.hpp"
+#include "QueueWaiter.hpp"
+#include "SPSCQueue.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+
+// One writer, several readers, one copy of the data. Every reader has its own
+// position in the same ring, so adding a consumer costs a cache line of
+// bookkeeping instead of another queue and another memcpy per block.
+//
+// Lossless readers hold the writer back: it waits for the slowest of them
+// like it would on a full SPSCQueue, and they can work on ring memory in
+// place (peek/consume). Lossy readers never slow the writer down. If one
+// falls a whole ring behind it is skipped ahead and told how many bytes it
+// missed; since the writer may overwrite what a lossy reader is looking at,
+// they always copy out with pop(), which detects such overwrites.
+class BroadcastRing {
+public:
+  enum ReaderMode { LOSSLESS, LOSSY };
+  using ReaderId = std::size_t;
+  using WriteRegion = RingRegion<uint8_t>;
+  using ReadRegion = RingRegion<const uint8_t>;
+
+  static constexpr std::size_t MAX_READERS = 8;
+
+  // size has to be a power of 2, the memory is mirrored when possible so
+  // regions are always contiguous
+  BroadcastRing(std::size_t size)
+      : readers(new Reader[MAX_READERS]), buf_size(size), mask(size - 1) {
+    if ((size & (size - 1)) != 0) {
+      throw std::invalid_argument("BroadcastRing size has to be a power of 2");
+    }
+
+    try {
+      mirror = MirroredBuffer(size);
+      storage = mirror.data();
+      contiguous_end = 2 * size;
+    } catch (const std::exception &e) {
+      std::cerr << "Warning: No mirrored ring (" << e.what()
+                << "), using a plain one\n";
+      buffer = StreamBuffer(size);
+      storage = buffer.data();
+      contiguous_end = size;
+    }
+  }
+
+  BroadcastRing(const BroadcastRing &) = delete;
+  BroadcastRing &operator=(const BroadcastRing &) = delete;
+
+  // Readers have to be added before the writer starts. A new reader starts
+  // at the current write position.
+  ReaderId add_reader(ReaderMode mode) {
+    if (num_readers == MAX_READERS) {
+      throw std::runtime_error("BroadcastRing has no room for more readers");
+    }
+    Reader &reader = readers[num_readers];
+    reader.mode = mode;
+    reader.tail.store(head.load(std::memory_order_relaxed),
+                      std::memory_order_relaxed);
+    reader.cached_head = reader.tail.load(std::memory_order_relaxed);
+    return num_readers++;
+  }
+
+  // Same as SPSCQueue::set_wait_strategy(), for the writer and all readers
+  void set_wait_strategy(WaitStrategy new_strategy) {
+    strategy = new_strategy;
+  }
+
+  // ---- Writer side ----
+
+  // Up to max_size bytes of room to fill in place, limited by the slowest
+  // lossless reader. Publish them with commit().
+  WriteRegion reserve(std::size_t max_size) {
+    std::size_t curr_head = head.load(std::memory_order_relaxed);
+    std::size_t len = std::min(max_size, writable(max_size));
+
+    // Lossy readers check this after copying to see whether we got to their
+    // bytes first. The fence keeps it ahead of the stores into the region.
+    write_limit.store(curr_head + len, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    return region<uint8_t>(curr_head, len);
+  }
+
+  void commit(std::size_t len) {
+    std::size_t new_head = head.load(std::memory_order_relaxed) + len;
+    head.store(new_head, std::memory_order_release);
+
+    if (strategy == WaitStrategy::BLOCK) {
+      for (std::size_t i = 0; i < num_readers; i++) {
+        readers[i].data_waiter.notify(
+            new_head - readers[i].tail.load(std::memory_order_relaxed));
+      }
+    }
+  }
+
+  // Copies len bytes in, all or nothing
+  bool push(const uint8_t *data, std::size_t len) {
+    if (writable(len) < len) {
+      return false;
+    }
+    WriteRegion region = reserve(len);
+    std::memcpy(region.first, data, region.first_len);
+    std::memcpy(region.second, data + region.first_len, region.second_len);
+    commit(len);
+    return true;
+  }
+
+  // Waits until len bytes can be written, at most timeout
+  bool wait_for_space(std::size_t len, std::chrono::nanoseconds timeout) {
+    if (writable(len) >= len) {
+      return true;
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool ready = space_waiter.wait(
+        len, [&] { return writable(len) >= len; }, timeout, strategy);
+    writer_stats.note_wait(std::chrono::steady_clock::now() - start);
+    return ready;
+  }
+
+  // Total bytes ever written, marks a point in the stream for
+  // discard_until()
+  std::size_t write_position() const {
+    return head.load(std::memory_order_relaxed);
+  }
+
+  // ---- Reader side, each reader from its own thread ----
+
+  // Lossless readers only: up to max_size unread bytes in place, hand them
+  // back with consume()
+  ReadRegion peek(ReaderId id, std::size_t max_size) {
+    Reader &reader = readers[id];
+    std::size_t len = std::min(max_size, readable(reader, max_size));
+    if (len == 0) {
+      reader.stats.note_empty();
+    }
+    return region<const uint8_t>(reader.tail.load(std::memory_order_relaxed),
+                                 len);
+  }
+
+  void consume(ReaderId id, std::size_t len) {
+    Reader &reader = readers[id];
+    reader.tail.store(reader.tail.load(std::memory_order_relaxed) + len,
+                      std::memory_order_release);
+    notify_space(reader);
+  }
+
+  // Copies up to max_size unread bytes to dest. For a lossy reader, bytes
+  // the writer overwrote before or while we copied them are skipped and
+  // added to missed().
+  std::size_t pop(ReaderId id, uint8_t *dest, std::size_t max_size) {
+    Reader &reader = readers[id];
+    std::size_t start = reader.tail.load(std::memory_order_relaxed);
+
+    if (reader.mode == LOSSY) {
+      // Everything the writer may already be writing over is gone
+      std::size_t oldest =
+          write_limit.load(std::memory_order_acquire) - buf_size;
+      if (later(oldest, start)) {
+        skip(reader, oldest - start);
+        start = oldest;
+        reader.tail.store(start, std::memory_order_relaxed);
+      }
+    }
+
+    std::size_t len = std::min(max_size, readable(reader, max_size));
+    if (len == 0) {
+      reader.stats.note_empty();
+    }
+    ReadRegion src = region<const uint8_t>(start, len);
+    std::memcpy(dest, src.first, src.first_len);
+    std::memcpy(dest + src.first_len, src.second, src.second_len);
+
+    if (reader.mode == LOSSY) {
+      // Did the writer reserve any of it while we were copying?
+      std::atomic_thread_fence(std::memory_order_acquire);
+      std::size_t oldest =
+          write_limit.load(std::memory_order_relaxed) - buf_size;
+      if (later(oldest, start)) {
+        // Keep I and Q together
+        std::size_t torn =
+            std::min(len, (oldest - start + 1) & ~std::size_t(1));
+        skip(reader, torn);
+        std::memmove(dest, dest + torn, len - torn);
+        start += torn;
+        len -= torn;
+      }
+    }
+
+    reader.tail.store(start + len, std::memory_order_release);
+    if (reader.mode == LOSSLESS) {
+      notify_space(reader);
+    }
+    return len;
+  }
+
+  // Moves a reader forward so at most keep unread bytes are left, e.g. for
+  // a display that only wants the newest samples. Returns how many bytes
+  // were skipped, those don't count as missed.
+  std::size_t skip_to_latest(ReaderId id, std::size_t keep) {
+    Reader &reader = readers[id];
+    std::size_t available = readable(reader, SIZE_MAX);
+    if (available <= keep) {
+      return 0;
+    }
+    std::size_t skipped = (available - keep) & ~std::size_t(1);
+    reader.tail.store(reader.tail.load(std::memory_order_relaxed) + skipped,
+                      std::memory_order_release);
+    notify_space(reader);
+    return skipped;
+  }
+
+  // Drops everything written before position, a value write_position()
+  // returned
+  void discard_until(ReaderId id, std::size_t position) {
+    Reader &reader = readers[id];
+    std::size_t tail = reader.tail.load(std::memory_order_relaxed);
+    if (later(position, tail)) {
+      std::size_t available = readable(reader, position - tail);
+      reader.tail.store(tail + std::min(position - tail, available),
+                        std::memory_order_release);
+      notify_space(reader);
+    }
+  }
+
+  // Waits until the reader has at least len unread bytes, at most timeout
+  bool wait_for_data(ReaderId id, std::size_t len,
+                     std::chrono::nanoseconds timeout) {
+    Reader &reader = readers[id];
+    return reader.data_waiter.wait(
+        len, [&] { return readable(reader, len) >= len; }, timeout, strategy);
+  }
+
+  // Unread bytes of a reader
+  std::size_t size(ReaderId id) const {
+    const Reader &reader = readers[id];
+    return head.load(std::memory_order_acquire) -
+           reader.tail.load(std::memory_order_relaxed);
+  }
+
+  // Bytes a lossy reader lost because it fell behind
+  uint64_t missed(ReaderId id) const {
+    return readers[id].missed.load(std::memory_order_relaxed);
+  }
+
+  // Counters for monitoring one reader, see SPSCQueue::telemetry(). The
+  // high water mark and full waits are the writer's, so they only show up
+  // for lossless readers (they are what the writer waits for), and with
+  // several of those only one should be collected. dropped is missed().
+  QueueTelemetry telemetry(ReaderId id) {
+    Reader &reader = readers[id];
+    ProducerTelemetry unused;
+    QueueTelemetry t =
+        collect_telemetry(reader.mode == LOSSLESS ? writer_stats : unused,
+                          reader.stats, buf_size,
+                          std::min(size(id), buf_size));
+    t.dropped = missed(id);
+    return t;
+  }
+
+private:
+  struct alignas(64) Reader {
+    // Written by the reader, read by the writer when it runs out of room
+    std::atomic<std::size_t> tail{0};
+    // Reader's private copy of head
+    std::size_t cached_head = 0;
+    ReaderMode mode = LOSSLESS;
+    std::atomic<uint64_t> missed{0};
+    ConsumerTelemetry stats;
+    QueueWaiter data_waiter;
+  };
+
+  // a comes after b in the stream, works across wrap-around
+  static bool later(std::size_t a, std::size_t b) {
+    return static_cast<std::ptrdiff_t>(a - b) > 0;
+  }
+
+  void skip(Reader &reader, std::size_t len) {
+    reader.missed.fetch_add(len, std::memory_order_relaxed);
+  }
+
+  // Room up to the slowest lossless reader. Their tails are only re-read
+  // when the cached minimum says there isn't enough.
+  std::size_t writable(std::size_t wanted) {
+    std::size_t curr_head = head.load(std::memory_order_relaxed);
+    std::size_t space = buf_size - (curr_head - cached_min_tail);
+    if (space < wanted) {
+      cached_min_tail = curr_head;
+      for (std::size_t i = 0; i < num_readers; i++) {
+        if (readers[i].mode == LOSSLESS) {
+          std::size_t tail =
+              readers[i].tail.load(std::memory_order_acquire);
+          if (later(cached_min_tail, tail)) {
+            cached_min_tail = tail;
+          }
+        }
+      }
+      space = buf_size - (curr_head - cached_min_tail);
+      writer_stats.note_fill(curr_head - cached_min_tail);
+    }
+    return space;
+  }
+
+  std::size_t readable(Reader &reader, std::size_t wanted) {
+    std::size_t tail = reader.tail.load(std::memory_order_relaxed);
+    std::size_t available = reader.cached_head - tail;
+    // A lossy reader that was skipped ahead can be past its cached head
+    if (later(tail, reader.cached_head) || available < wanted) {
+      reader.cached_head = head.load(std::memory_order_acquire);
+      available = reader.cached_head - tail;
+      reader.stats.note_fill(available);
+    }
+    return available;
+  }
+
+  void notify_space(Reader &reader) {
+    if (strategy == WaitStrategy::BLOCK && reader.mode == LOSSLESS) {
+      // This reader's view of the room, an overestimate if another lossless
+      // reader is further behind, which only costs a spurious wake-up
+      space_waiter.notify(buf_size - (reader.cached_head -
+                                      reader.tail.load(
+                                          std::memory_order_relaxed)));
+    }
+  }
+
+  template <typename Byte>
+  RingRegion<Byte> region(std::size_t position, std::size_t len) const {
+    std::size_t index = position & mask;
+    std::size_t first_len = std::min(len, contiguous_end - index);
+    return {storage + index, first_len, storage, len - first_len};
+  }
+
+  // Only touched while constructing
+  StreamBuffer buffer;
+  MirroredBuffer mirror;
+  std::unique_ptr<Reader[]> readers;
+
+  // Read-only once the writer runs
+  alignas(64) uint8_t *storage = nullptr;
+  std::size_t buf_size;
+  std::size_t mask;
+  std::size_t contiguous_end = 0;
+  std::size_t num_readers = 0;
+  WaitStrategy strategy = WaitStrategy::BLOCK;
+
+  // Writer's line
+  alignas(64) std::atomic<std::size_t> head{0};
+  std::atomic<std::size_t> write_limit{0};
+  std::size_t cached_min_tail = 0;
+  ProducerTelemetry writer_stats;
+
+  alignas(64) QueueWaiter space_waiter;
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+#include "FirDecimator.hpp"
+#include "StreamBuffer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <vector>
+
+// Decimates raw uint8_t IQ by factor with a cascaded integrator-comb filter
+// (Hogenauer): stages running sums at the input rate, then stages first
+// differences at the output rate. That is stages moving averages over factor
+// samples in a row, at a cost of 2 * stages integer adds per input sample
+// and channel, whatever the factor, and without a single multiply.
+//
+// The sums are allowed to wrap around: with two's complement arithmetic the
+// differences come out right anyway, as long as the registers are wider than
+// the output needs, 9 + stages * log2(factor) bits for our input.
+//
+// The moving averages droop towards the edge of the output band and only
+// stop the bands that fold onto DC well, so a CicDecimator is followed by a
+// compensation FIR, see design_cic_compensator().
+class CicDecimator {
+public:
+  // Each stage adds about 12 dB on what folds into a channel of a fifth of
+  // the output rate, and log2(factor) bits to the registers
+  static constexpr int MAX_STAGES = 6;
+
+  CicDecimator(int factor, int stages, std::size_t max_block)
+      : factor(factor), stages(stages), out(max_block / factor + 1) {
+    if (factor < 2 || stages < 1 || stages > MAX_STAGES ||
+        9 + stages * std::log2(factor) > 64) {
+      throw std::invalid_argument("CicDecimator needs a factor >= 2, 1 to "
+                                  "MAX_STAGES stages and at most 64 bits");
+    }
+    // The DC gain of the filter is factor^stages
+    scale = 1.0 / (255.0 * std::pow(factor, stages));
+    reset();
+  }
+
+  void reset() {
+    state = {};
+    phase = 0;
+  }
+
+  // n raw IQ pairs in (n <= max_block), returns the number of samples in
+  // output(), which are scaled to -1..1
+  std::size_t process(const uint8_t *raw_iq, std::size_t n) {
+    switch (stages) {
+    case 1:
+      return run<1>(raw_iq, n);
+    case 2:
+      return run<2>(raw_iq, n);
+    case 3:
+      return run<3>(raw_iq, n);
+    case 4:
+      return run<4>(raw_iq, n);
+    case 5:
+      return run<5>(raw_iq, n);
+    default:
+      return run<6>(raw_iq, n);
+    }
+  }
+
+  const std::complex<float> *output() const { return out.data(); }
+  int decimation() const { return factor; }
+  int order() const { return stages; }
+
+  // Magnitude response relative to DC at frequency f, as a fraction of the
+  // output rate
+  static double response(double f, int factor, int stages) {
+    if (f == 0.0) {
+      return 1.0;
+    }
+    return std::pow(std::fabs(std::sin(M_PI * f) /
+                              (factor * std::sin(M_PI * f / factor))),
+                    stages);
+  }
+
+private:
+  // Integrator and comb registers, [stage][0] for I and [stage][1] for Q
+  struct State {
+    uint64_t integrators[MAX_STAGES][2];
+    uint64_t combs[MAX_STAGES][2];
+  };
+
+  // With the number of stages known the registers live in CPU registers,
+  // and the inner loop runs up to the next output without a branch
+  template <int STAGES>
+  std::size_t run(const uint8_t *raw_iq, std::size_t n) {
+    State s = state;
+    std::size_t produced = 0;
+    std::size_t k = 0;
+    while (k < n) {
+      std::size_t end = std::min(n, k + (factor - phase));
+      phase += static_cast<int>(end - k);
+      for (; k < end; k++) {
+        // 2 * x - 255 centres the samples on zero in odd integers
+        uint64_t i = static_cast<uint64_t>(2 * raw_iq[2 * k] - 255);
+        uint64_t q = static_cast<uint64_t>(2 * raw_iq[2 * k + 1] - 255);
+        // Unrolled, or -O2 leaves the registers in memory
+#pragma GCC unroll 8
+        for (int j = 0; j < STAGES; j++) {
+          i = s.integrators[j][0] += i;
+          q = s.integrators[j][1] += q;
+        }
+      }
+      if (phase < factor) {
+        break;
+      }
+
+      phase = 0;
+      uint64_t y[2] = {s.integrators[STAGES - 1][0],
+                       s.integrators[STAGES - 1][1]};
+#pragma GCC unroll 8
+      for (int i = 0; i < STAGES; i++) {
+        for (int c = 0; c < 2; c++) {
+          uint64_t previous = s.combs[i][c];
+          s.combs[i][c] = y[c];
+          y[c] -= previous;
+        }
+      }
+      // Back from two's complement
+      out[produced++] = {
+          static_cast<float>(static_cast<int64_t>(y[0]) * scale),
+          static_cast<float>(static_cast<int64_t>(y[1]) * scale)};
+    }
+    state = s;
+    return produced;
+  }
+
+  int factor;
+  int stages;
+  double scale;
+  State state;
+  StreamArray<std::complex<float>> out;
+  // Inputs since the last output
+  int phase;
+};
+
+// Low-pass meeting spec at the output rate of a CicDecimator(factor, stages),
+// that also undoes the CIC's droop in the passband: the Kaiser windowed
+// inverse transform of 1 / CicDecimator::response up to the cutoff, which
+// design_lowpass() does in closed form for a flat passband.
+inline std::vector<float> design_cic_compensator(const LowpassSpec &spec,
+                                                 int factor, int stages) {
+  std::size_t num_taps = kaiser_length(spec);
+  std::vector<double> taps = kaiser_window(num_taps, spec.attenuation_db);
+  double cutoff = (spec.passband + spec.stopband) / 2.0;
+  double center = (num_taps - 1) / 2.0;
+
+  // h(t) = 2 * integral from 0 to cutoff of cos(2 pi f t) / response(f),
+  // by the midpoint rule
+  const int steps = 2048;
+  double df = cutoff / steps;
+  std::vector<double> gain(steps);
+  for (int j = 0; j < steps; j++) {
+    gain[j] = 1.0 / CicDecimator::response((j + 0.5) * df, factor, stages);
+  }
+  for (std::size_t k = 0; k < num_taps; k++) {
+    double t = k - center;
+    double sum = 0.0;
+    for (int j = 0; j < steps; j++) {
+      sum += gain[j] * std::cos(2.0 * M_PI * (j + 0.5) * df * t);
+    }
+    taps[k] *= 2.0 * sum * df;
+  }
+  return normalize_taps(taps);
+}
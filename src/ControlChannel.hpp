@@ -0,0 +1,54 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Lock-free mailbox for tuning changes. Any thread (GUI, signal handler,
+// network) can post a request, the producer picks up the latest values
+// between two blocks. Requests that pile up before the producer gets to them
+// collapse into one, only the newest value of each setting is applied.
+class ControlChannel {
+public:
+  enum Setting : uint32_t {
+    FREQUENCY = 1 << 0,
+    GAIN = 1 << 1,
+    SAMPLE_RATE = 1 << 2,
+  };
+
+  struct Request {
+    int frequency;
+    int gain_db;
+    int sample_rate;
+  };
+
+  void set_frequency(int hz) { post(frequency, hz, FREQUENCY); }
+  void set_gain(int gain_db) { post(gain, gain_db, GAIN); }
+  void set_sample_rate(int hz) { post(sample_rate, hz, SAMPLE_RATE); }
+
+  // Producer side. Fills request and returns a mask of the settings that
+  // were posted since the last call, 0 if nothing changed.
+  uint32_t take(Request &request) {
+    // Cheap check first, this runs once per block
+    if (pending.load(std::memory_order_relaxed) == 0) {
+      return 0;
+    }
+
+    uint32_t changes = pending.exchange(0, std::memory_order_acquire);
+    request.frequency = frequency.load(std::memory_order_relaxed);
+    request.gain_db = gain.load(std::memory_order_relaxed);
+    request.sample_rate = sample_rate.load(std::memory_order_relaxed);
+    return changes;
+  }
+
+private:
+  void post(std::atomic<int> &setting, int value, Setting bit) {
+    setting.store(value, std::memory_order_relaxed);
+    // Release so take() sees the value once it sees the bit
+    pending.fetch_or(bit, std::memory_order_release);
+  }
+
+  std::atomic<int> frequency{0};
+  std::atomic<int> gain{0};
+  std::atomic<int> sample_rate{0};
+  std::atomic<uint32_t> pending{0};
+};
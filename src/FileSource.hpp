@@ -0,0 +1,112 @@
+#pragma once
+
+#include "IQSource.hpp"
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+
+// Replays a raw rtl_sdr capture (.cu8: unsigned 8-bit interleaved IQ).
+// When paced, samples are handed out no faster than the configured sample
+// rate, otherwise as fast as the consumers can take them.
+class FileSource : public IQSource {
+public:
+  FileSource(const std::string &path, bool paced = true)
+      : path(path), paced(paced) {}
+
+  ~FileSource() override {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  FileSource(const FileSource &) = delete;
+  FileSource &operator=(const FileSource &) = delete;
+
+  void open() override {
+    fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open " + path + ": " +
+                               std::strerror(errno));
+    }
+    std::cout << "Replaying " << path << (paced ? "" : " (unpaced)") << "\n";
+  }
+
+  void configure(int sample_rate, int frequency, int gain_db) override {
+    // A recording has a fixed rate/frequency, we only need the rate to pace
+    this->sample_rate = sample_rate;
+    (void)frequency;
+    (void)gain_db;
+  }
+
+  bool retune(int frequency) override {
+    std::cerr << "Warning: Cannot retune a recording (requested " << frequency
+              << " Hz)\n";
+    return false;
+  }
+
+  bool set_gain(int gain_db) override {
+    std::cerr << "Warning: Cannot change the gain of a recording (requested "
+              << gain_db << " dB)\n";
+    return false;
+  }
+
+  bool set_sample_rate(int sample_rate) override {
+    std::cerr << "Warning: Cannot change the sample rate of a recording "
+              << "(requested " << sample_rate << " Hz)\n";
+    return false;
+  }
+
+  std::size_t read(uint8_t *dest, std::size_t max_size) override {
+    std::size_t bytes_read = 0;
+
+    // read() may return less than asked for, keep going until EOF
+    while (bytes_read < max_size) {
+      ssize_t r = ::read(fd, dest + bytes_read, max_size - bytes_read);
+      if (r < 0) {
+        if (errno == EINTR)
+          continue;
+        throw std::runtime_error("Error reading from " + path);
+      }
+      if (r == 0)
+        break;
+      bytes_read += static_cast<std::size_t>(r);
+    }
+
+    if (paced) {
+      pace(bytes_read);
+    }
+
+    return bytes_read;
+  }
+
+protected:
+  // Sleeps until the wall clock has caught up with the bytes handed out
+  void pace(std::size_t bytes) {
+    if (bytes_delivered == 0) {
+      start_time = std::chrono::steady_clock::now();
+    }
+    bytes_delivered += bytes;
+
+    // 2 bytes per complex sample
+    double seconds = static_cast<double>(bytes_delivered) / 2.0 / sample_rate;
+    std::this_thread::sleep_until(
+        start_time + std::chrono::duration_cast<std::chrono::nanoseconds>(
+                         std::chrono::duration<double>(seconds)));
+  }
+
+  std::string path;
+  bool paced;
+  int fd = -1;
+  int sample_rate = 1;
+
+  std::chrono::steady_clock::time_point start_time;
+  std::size_t bytes_delivered = 0;
+};
@@ -0,0 +1,208 @@
+#pragma once
+
+#include "Simd.hpp"
+#include "StreamBuffer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+// What a low-pass has to do, frequencies as fractions of its sample rate
+// (0.5 is Nyquist): pass up to passband, attenuate by attenuation_db from
+// stopband on.
+struct LowpassSpec {
+  double passband;
+  double stopband;
+  double attenuation_db = 60.0;
+};
+
+// Modified Bessel function of the first kind, order 0, for the Kaiser window
+inline double bessel_i0(double x) {
+  double sum = 1.0;
+  double term = 1.0;
+  for (int k = 1; term > 1e-12 * sum; k++) {
+    term *= (x / (2.0 * k)) * (x / (2.0 * k));
+    sum += term;
+  }
+  return sum;
+}
+
+// Length of the shortest Kaiser windowed filter that meets spec, from
+// Kaiser's formula. Odd, so the delay is a whole number of samples.
+inline std::size_t kaiser_length(const LowpassSpec &spec) {
+  if (spec.passband <= 0.0 || spec.stopband <= spec.passband ||
+      spec.stopband > 0.5) {
+    throw std::invalid_argument("Low-pass needs 0 < passband < stopband <= "
+                                "0.5 of the sample rate");
+  }
+  double width = 2.0 * M_PI * (spec.stopband - spec.passband);
+  return static_cast<std::size_t>(
+             std::ceil((spec.attenuation_db - 8.0) / (2.285 * width))) |
+         1;
+}
+
+// Kaiser window giving attenuation_db in the stopband
+inline std::vector<double> kaiser_window(std::size_t num_taps,
+                                         double attenuation_db) {
+  double a = attenuation_db;
+  double beta = a > 50.0   ? 0.1102 * (a - 8.7)
+                : a > 21.0 ? 0.5842 * std::pow(a - 21.0, 0.4) +
+                                 0.07886 * (a - 21.0)
+                           : 0.0;
+  double center = (num_taps - 1) / 2.0;
+  std::vector<double> window(num_taps);
+  for (std::size_t k = 0; k < num_taps; k++) {
+    double r = center > 0.0 ? (k - center) / center : 0.0;
+    window[k] = bessel_i0(beta * std::sqrt(1.0 - r * r)) / bessel_i0(beta);
+  }
+  return window;
+}
+
+// Scales taps to unity gain at DC
+inline std::vector<float> normalize_taps(const std::vector<double> &taps) {
+  double sum = 0.0;
+  for (double tap : taps) {
+    sum += tap;
+  }
+  std::vector<float> normalized(taps.size());
+  for (std::size_t k = 0; k < taps.size(); k++) {
+    normalized[k] = static_cast<float>(taps[k] / sum);
+  }
+  return normalized;
+}
+
+// Kaiser windowed sinc meeting spec, with unity gain at DC
+inline std::vector<float> design_lowpass(const LowpassSpec &spec) {
+  std::size_t num_taps = kaiser_length(spec);
+  std::vector<double> taps = kaiser_window(num_taps, spec.attenuation_db);
+  double cutoff = (spec.passband + spec.stopband) / 2.0;
+  double center = (num_taps - 1) / 2.0;
+  for (std::size_t k = 0; k < num_taps; k++) {
+    double t = k - center;
+    taps[k] *= t == 0.0 ? 2.0 * cutoff
+                        : std::sin(2.0 * M_PI * cutoff * t) / (M_PI * t);
+  }
+  return normalize_taps(taps);
+}
+
+// Low-pass filters a stream of T (float or std::complex<float>) and keeps
+// every factor-th output. This is the polyphase decimator without the
+// bookkeeping: each kept output is one inner product of the taps with the
+// newest inputs, and the outputs in between are never computed, so it costs
+// taps / factor multiply-adds per input sample. The inner products run on
+// simd:: vectors, complex samples stay interleaved and are multiplied by
+// duplicated taps. The last taps - 1 inputs are kept as history, so a stream
+// can be fed in pieces of any size up to max_block.
+template <typename T> class FirDecimator {
+  static_assert(std::is_same<T, float>::value ||
+                    std::is_same<T, std::complex<float>>::value,
+                "FirDecimator works on float or std::complex<float>");
+
+public:
+  // Floats per sample
+  static constexpr std::size_t CHANNELS = sizeof(T) / sizeof(float);
+
+  FirDecimator(int factor, const std::vector<float> &taps,
+               std::size_t max_block)
+      : factor(factor), num_taps(taps.size()) {
+    if (factor < 1 || taps.empty()) {
+      throw std::invalid_argument("FirDecimator needs taps and a factor >= 1");
+    }
+
+    // Zero taps in front (on the oldest inputs) round the inner product up
+    // to whole pairs of vectors
+    std::size_t step = 2 * simd::WIDTH / CHANNELS;
+    padded = (num_taps + step - 1) / step * step;
+    history = padded - 1;
+    // Reversed, oldest input first, and one copy per channel
+    expanded.assign(padded * CHANNELS, 0.0f);
+    for (std::size_t k = 0; k < num_taps; k++) {
+      for (std::size_t c = 0; c < CHANNELS; c++) {
+        expanded[(padded - 1 - k) * CHANNELS + c] = taps[k];
+      }
+    }
+
+    buffer = StreamArray<float>((history + max_block) * CHANNELS);
+    out = StreamArray<T>(max_block / factor + 1);
+    reset();
+  }
+
+  void reset() {
+    std::fill(buffer.begin(), buffer.end(), 0.0f);
+    // The first output comes after factor inputs
+    next = history + factor - 1;
+  }
+
+  // n samples in (n <= max_block), returns the number of samples in
+  // output()
+  std::size_t process(const T *in, std::size_t n) {
+    const float *samples = reinterpret_cast<const float *>(in);
+    std::copy(samples, samples + n * CHANNELS,
+              buffer.begin() + history * CHANNELS);
+    std::size_t total = history + n;
+
+    std::size_t produced = 0;
+    for (; next < total; next += factor) {
+      const float *x = buffer.data() + (next - history) * CHANNELS;
+      out[produced++] = inner_product(x);
+    }
+
+    // Slide the history to the front for the next call
+    std::copy(buffer.begin() + n * CHANNELS, buffer.begin() + total * CHANNELS,
+              buffer.begin());
+    next -= n;
+    return produced;
+  }
+
+  const T *output() const { return out.data(); }
+  int decimation() const { return factor; }
+  std::size_t taps() const { return num_taps; }
+
+private:
+  // Two accumulators hide the add latency, and with an odd number of
+  // lanes per vector (scalar builds) they keep I and Q apart
+  T inner_product(const float *x) const {
+    const float *h = expanded.data();
+    simd::Floats acc0 = simd::broadcast(0.0f);
+    simd::Floats acc1 = simd::broadcast(0.0f);
+    for (std::size_t k = 0; k < padded * CHANNELS; k += 2 * simd::WIDTH) {
+      acc0 = simd::mul_add(simd::load(x + k), simd::load(h + k), acc0);
+      acc1 = simd::mul_add(simd::load(x + k + simd::WIDTH),
+                           simd::load(h + k + simd::WIDTH), acc1);
+    }
+
+    if constexpr (CHANNELS == 1) {
+      return simd::sum(acc0 + acc1);
+    } else {
+      // Even lanes hold I, odd lanes Q
+      float lanes[2 * simd::WIDTH];
+      simd::store(lanes, acc0);
+      simd::store(lanes + simd::WIDTH, acc1);
+      float re = 0.0f;
+      float im = 0.0f;
+      for (std::size_t i = 0; i < 2 * simd::WIDTH; i += 2) {
+        re += lanes[i];
+        im += lanes[i + 1];
+      }
+      return {re, im};
+    }
+  }
+
+  int factor;
+  std::size_t num_taps;
+  // num_taps rounded up to what the inner product works on
+  std::size_t padded;
+  std::size_t history;
+  std::vector<float> expanded;
+  // history samples followed by the current input
+  StreamArray<float> buffer;
+  StreamArray<T> out;
+  // Index in buffer of the newest input of the next output
+  std::size_t next;
+};
+
+using RealDecimator = FirDecimator<float>;
+using ComplexDecimator = FirDecimator<std::complex<float>>;
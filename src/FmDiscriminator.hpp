@@ -0,0 +1,106 @@
+#pragma once
+
+#include "Simd.hpp"
+#include <cmath>
+#include <cstddef>
+
+// Turns complex samples into FM: the phase step from each sample to the
+// next, in radians. Multiplying a sample by the conjugate of the previous
+// one gives a complex number whose angle is exactly that step:
+// r1 * e^(i*p1) * conj(r2 * e^(i*p2)) = r1 * r2 * e^(i(p1 - p2)),
+// so all that is left is an atan2 per sample.
+//
+// EXACT calls std::atan2 on every sample. FAST runs simd::WIDTH samples at a
+// time with a polynomial atan2 (Abramowitz & Stegun 4.4.49, 1e-5 rad) that is
+// off by at most MAX_ERROR radians after float rounding, far below what 8 bit
+// samples can resolve. The conjugate products run in the same vectors.
+//
+// On its own FAST is about 20x EXACT with SSE2 (bench/fm_discriminator). In
+// AudioProcessor the discriminator only sees the IF rate and the decimation
+// filters do most of the work, so a whole chain gains about 1.8x.
+class FmDiscriminator {
+public:
+  enum class Mode { EXACT, FAST };
+
+  static constexpr float MAX_ERROR = 1.2e-5f;
+
+  explicit FmDiscriminator(Mode mode = Mode::FAST) : mode(mode) {}
+
+  void set_mode(Mode new_mode) { mode = new_mode; }
+  Mode get_mode() const { return mode; }
+
+  // The next sample is compared against 1 + 0i
+  void reset() {
+    prev_i = 1.0f;
+    prev_q = 0.0f;
+  }
+
+  // n interleaved I/Q pairs in, n phase steps out. Remembers the last
+  // sample, so a stream can be fed in pieces.
+  void process(const float *iq, std::size_t n, float *phase) {
+    if (n == 0) {
+      return;
+    }
+
+    // The first sample's predecessor is from the last call
+    phase[0] = step(iq[0], iq[1], prev_i, prev_q);
+    std::size_t k = 1;
+    if (mode == Mode::FAST) {
+      // From here on the predecessor is just the pair before in iq
+      for (; k + simd::WIDTH <= n; k += simd::WIDTH) {
+        simd::Floats i, q, pi, pq;
+        simd::deinterleave(iq + 2 * k, i, q);
+        simd::deinterleave(iq + 2 * (k - 1), pi, pq);
+        // current * conj(previous)
+        simd::Floats re = simd::mul_add(i, pi, q * pq);
+        simd::Floats im = q * pi - i * pq;
+        simd::store(phase + k, atan2(im, re));
+      }
+    }
+    for (; k < n; k++) {
+      phase[k] = step(iq[2 * k], iq[2 * k + 1], iq[2 * k - 2], iq[2 * k - 1]);
+    }
+
+    prev_i = iq[2 * n - 2];
+    prev_q = iq[2 * n - 1];
+  }
+
+  // Same polynomial as FAST, one value at a time
+  static float fast_atan2(float y, float x) {
+    return simd::first(atan2(simd::broadcast(y), simd::broadcast(x)));
+  }
+
+private:
+  float step(float i, float q, float pi, float pq) const {
+    float re = i * pi + q * pq;
+    float im = q * pi - i * pq;
+    return mode == Mode::FAST ? fast_atan2(im, re) : std::atan2(im, re);
+  }
+
+  static simd::Floats atan2(simd::Floats y, simd::Floats x) {
+    using simd::Floats;
+    Floats ax = simd::abs(x);
+    Floats ay = simd::abs(y);
+    // Fold everything into atan(a) with 0 <= a <= 1, where the polynomial
+    // holds. Both zero gives 0, like std::atan2(0, 0).
+    Floats a = simd::min(ax, ay) /
+               simd::max(simd::max(ax, ay), simd::broadcast(1e-30f));
+    Floats s = a * a;
+    Floats r = simd::mul_add(s, simd::broadcast(0.0208351f),
+                             simd::broadcast(-0.0851330f));
+    r = simd::mul_add(r, s, simd::broadcast(0.1801410f));
+    r = simd::mul_add(r, s, simd::broadcast(-0.3302995f));
+    r = simd::mul_add(r, s, simd::broadcast(0.9998660f));
+    r = r * a;
+    // And unfold: steeper than 45 degrees, left half plane, lower half plane
+    r = simd::select(ax < ay, simd::broadcast(1.57079637f) - r, r);
+    r = simd::select(x < simd::broadcast(0.0f),
+                     simd::broadcast(3.14159274f) - r, r);
+    return r ^ simd::sign_bits(y);
+  }
+
+  Mode mode;
+  // Last sample of the previous call
+  float prev_i = 1.0f;
+  float prev_q = 0.0f;
+};
@@ -21,6 +21,8 @@ class GUIWindow {
 private:
   int sample_rate;
   int center_freq;
+  bool recording = false;
+  std::string status;
 
 public:
   GUIWindow(int width, int height, const std::string &title, int s_rate,
@@ -37,8 +39,47 @@ public:
 
   bool should_close() { return WindowShouldClose(); }
 
-  void draw(std::vector<uint8_t> &rawIQ_buffer, std::vector<float> &magnitudes,
-            std::size_t bytes_read, float *volume_level) {
+  // 'R' fires the recording trigger
+  bool trigger_pressed() { return IsKeyPressed(KEY_R); }
+
+  void set_recording(bool is_recording) { recording = is_recording; }
+
+  // Number keys 1-9 select a receiver, returns its 0-based index or -1
+  int receiver_key_pressed() {
+    for (int i = 0; i < 9; i++) {
+      if (IsKeyPressed(KEY_ONE + i)) {
+        return i;
+      }
+    }
+    return -1;
+  }
+
+  // Left/right arrow tune down/up, returns -1, 0 or 1
+  int tune_key_pressed() {
+    return IsKeyPressed(KEY_RIGHT) - IsKeyPressed(KEY_LEFT);
+  }
+
+  // Up/down arrow raise/lower the gain, returns -1, 0 or 1
+  int gain_key_pressed() {
+    return IsKeyPressed(KEY_UP) - IsKeyPressed(KEY_DOWN);
+  }
+
+  // Page up/down step the sample rate up/down, returns -1, 0 or 1
+  int rate_key_pressed() {
+    return IsKeyPressed(KEY_PAGE_UP) - IsKeyPressed(KEY_PAGE_DOWN);
+  }
+
+  void set_tuning(int s_rate, int c_freq) {
+    sample_rate = s_rate;
+    center_freq = c_freq;
+  }
+
+  // Short line shown in the top bar
+  void set_status(const std::string &text) { status = text; }
+
+  void draw(const std::vector<uint8_t> &rawIQ_buffer,
+            const std::vector<float> &magnitudes, std::size_t bytes_read,
+            float *volume_level) {
     BeginDrawing();
     ClearBackground(RAYWHITE);
 
@@ -54,6 +95,13 @@ public:
     int title_width = MeasureText(title, ui_height);
     DrawFPS(title_x + title_width + 15, ui_y);
 
+    if (recording) {
+      DrawText("REC", title_x + title_width + 110, ui_y, ui_height, RED);
+    }
+
+    DrawText(status.c_str(), title_x + title_width + 170, ui_y + 5, 10,
+             DARKGRAY);
+
     int screen_width = GetScreenWidth();
     int slider_width = 120;
     int slider_x = screen_width - slider_width - 50;
@@ -177,9 +225,9 @@ public:
     }
   }
 
-  void draw_rawIQ(std::vector<uint8_t> &rawIQ_buffer, std::size_t bytes_read,
-                  float *volume_level, float screen_width, float bottom_y,
-                  float top_y) {
+  void draw_rawIQ(const std::vector<uint8_t> &rawIQ_buffer,
+                  std::size_t bytes_read, float *volume_level,
+                  float screen_width, float bottom_y, float top_y) {
     float graph_height = bottom_y - top_y;
     // The maximum pixels the signal can travel up or down from the center
     float max_amplitude = graph_height / 2.0f;
@@ -0,0 +1,156 @@
+#pragma once
+
+#include "FirDecimator.hpp"
+#include "Simd.hpp"
+#include "StreamBuffer.hpp"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <stdexcept>
+#include <vector>
+
+// Halfband low-pass passing up to passband (a fraction of the input rate)
+// and stopping from 0.5 - passband on: a Kaiser windowed sinc cut off at a
+// quarter of the rate. Every other tap but the centre one is zero, and the
+// length is 4 * k - 1 so the outermost taps are not.
+inline std::vector<float> design_halfband(double passband,
+                                          double attenuation_db = 60.0) {
+  LowpassSpec spec{passband, 0.5 - passband, attenuation_db};
+  std::size_t num_taps = (kaiser_length(spec) + 4) / 4 * 4 - 1;
+  std::vector<double> taps = kaiser_window(num_taps, attenuation_db);
+  long center = static_cast<long>(num_taps / 2);
+  for (long k = 0; k < static_cast<long>(num_taps); k++) {
+    long t = k - center;
+    taps[k] *= t == 0       ? 0.5
+               : t % 2 == 0 ? 0.0
+                            : std::sin(M_PI * t / 2.0) / (M_PI * t);
+  }
+  return normalize_taps(taps);
+}
+
+// Decimates complex samples by 2 with a halfband filter from
+// design_halfband(). With the zero taps skipped and the symmetric pairs of
+// samples added before they are multiplied, an output of a 4 * k - 1 tap
+// filter costs k + 1 multiply-adds, about a quarter of what FirDecimator
+// does with the same taps. Splitting the input costs a pass over it though,
+// bench/decimation measures 1.2-2.6x the speed of a FirDecimator.
+//
+// The input is split into its odd samples, which meet the non-zero taps,
+// and its even ones, which only meet the centre tap. Outputs are computed
+// simd::WIDTH floats at a time, I and Q alike since the taps are real.
+// Cascaded, these take the power of two part of a decimation.
+class HalfbandDecimator {
+public:
+  HalfbandDecimator(const std::vector<float> &taps, std::size_t max_block)
+      : num_taps(taps.size()), pairs((taps.size() + 1) / 4) {
+    if (taps.size() < 3 || taps.size() % 4 != 3) {
+      throw std::invalid_argument("HalfbandDecimator needs 4 * k - 1 taps");
+    }
+    std::size_t center = num_taps / 2;
+    center_tap = taps[center];
+    // Outermost pair first, like the odd samples they go with
+    for (std::size_t j = 0; j < pairs; j++) {
+      pair_taps.push_back(taps[center + 2 * (pairs - j) - 1]);
+    }
+
+    odd = StreamArray<float>(2 * (odd_history() + max_block / 2 + 1));
+    even = StreamArray<float>(2 * (even_history() + max_block / 2 + 1));
+    out = StreamArray<std::complex<float>>(max_block / 2 + 1);
+    reset();
+  }
+
+  void reset() {
+    std::fill(odd.begin(), odd.end(), 0.0f);
+    std::fill(even.begin(), even.end(), 0.0f);
+    odd_next = false;
+  }
+
+  // n samples in (n <= max_block), returns the number of samples in
+  // output()
+  std::size_t process(const std::complex<float> *in, std::size_t n) {
+    // A stage after another one can get nothing, that must not lose track
+    // of an even sample waiting for its odd one
+    if (n == 0) {
+      return 0;
+    }
+
+    // Where the centre sample of the first output is in even, depends on
+    // whether the last call ended between an even and an odd sample
+    std::size_t center = odd_next ? 0 : 2;
+
+    const float *x = reinterpret_cast<const float *>(in);
+    float *a = odd.data() + 2 * odd_history();
+    float *b = even.data() + 2 * even_history();
+    std::size_t num_odd = 0;
+    std::size_t num_even = 0;
+    std::size_t k = 0;
+    if (odd_next && n > 0) {
+      std::copy(x, x + 2, a);
+      num_odd++;
+      k++;
+    }
+    // Whole even/odd pairs, then maybe an even sample whose odd one comes
+    // with the next call
+    for (; k + 2 <= n; k += 2) {
+      std::copy(x + 2 * k, x + 2 * k + 2, b + 2 * num_even++);
+      std::copy(x + 2 * k + 2, x + 2 * k + 4, a + 2 * num_odd++);
+    }
+    odd_next = k < n;
+    if (odd_next) {
+      std::copy(x + 2 * k, x + 2 * k + 2, b + 2 * num_even++);
+    }
+
+    // Every odd sample completes an output
+    a = odd.data();
+    b = even.data() + center;
+    float *y = reinterpret_cast<float *>(out.data());
+    std::size_t last = 2 * (2 * pairs - 1);
+    std::size_t f = 0;
+    for (; f + simd::WIDTH <= 2 * num_odd; f += simd::WIDTH) {
+      simd::Floats acc = simd::load(b + f) * simd::broadcast(center_tap);
+      for (std::size_t j = 0; j < pairs; j++) {
+        acc = simd::mul_add(
+            simd::load(a + f + 2 * j) + simd::load(a + f + last - 2 * j),
+            simd::broadcast(pair_taps[j]), acc);
+      }
+      simd::store(y + f, acc);
+    }
+    for (; f < 2 * num_odd; f++) {
+      float acc = b[f] * center_tap;
+      for (std::size_t j = 0; j < pairs; j++) {
+        acc += (a[f + 2 * j] + a[f + last - 2 * j]) * pair_taps[j];
+      }
+      y[f] = acc;
+    }
+
+    // Slide the histories to the front for the next call
+    std::copy(odd.begin() + 2 * num_odd,
+              odd.begin() + 2 * (num_odd + odd_history()), odd.begin());
+    std::copy(even.begin() + 2 * num_even,
+              even.begin() + 2 * (num_even + even_history()), even.begin());
+    return num_odd;
+  }
+
+  const std::complex<float> *output() const { return out.data(); }
+  int decimation() const { return 2; }
+  std::size_t taps() const { return num_taps; }
+
+private:
+  // Odd samples under the filter besides the newest one
+  std::size_t odd_history() const { return 2 * pairs - 1; }
+  // Enough for the centre sample of the first output either way
+  std::size_t even_history() const { return pairs; }
+
+  std::size_t num_taps;
+  // Non-zero taps on either side of the centre
+  std::size_t pairs;
+  float center_tap;
+  std::vector<float> pair_taps;
+  // Each a history followed by the current input, interleaved I/Q
+  StreamArray<float> odd;
+  StreamArray<float> even;
+  StreamArray<std::complex<float>> out;
+  // Whether the next input sample is an odd one
+  bool odd_next;
+};
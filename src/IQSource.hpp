@@ -0,0 +1,135 @@
+#pragma once
+
+#include "StreamBuffer.hpp"
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+
+// One complex sample in the rtl_sdr format, queues of these move whole pairs
+struct IQSample {
+  uint8_t i;
+  uint8_t q;
+};
+static_assert(sizeof(IQSample) == 2, "IQSample has to match the raw stream");
+
+// One contiguous run of samples handed out by a source
+struct IQBlock {
+  const uint8_t *data;
+  // Bytes, always a whole number of IQ pairs
+  std::size_t len;
+  // Counts up by one per block from the start of the stream
+  uint64_t sequence;
+  // Index of the first complex sample of this block in the stream
+  uint64_t first_sample;
+  // When the block was handed to us
+  std::chrono::steady_clock::time_point timestamp;
+  // Fewer bytes than the source asked for were delivered
+  bool short_read;
+
+  std::size_t samples() const { return len / 2; }
+};
+
+// Anything that produces interleaved unsigned 8-bit IQ samples (the format
+// rtl_sdr writes): a dongle, a recording, a network stream...
+class IQSource {
+public:
+  // Receives a block of IQ bytes. The data pointer is only valid until the
+  // callback returns.
+  using BlockCallback = std::function<void(const IQBlock &)>;
+
+  // Hands out the memory the next read() should fill, so a consumer that
+  // owns a ring can have samples land in it without a copy. len is the most
+  // the source wants to read and may be lowered. Returning nullptr makes
+  // stream() use its own buffer for that block.
+  using BufferProvider = std::function<uint8_t *(std::size_t &len)>;
+
+  virtual ~IQSource() = default;
+
+  // Acquire the underlying resource (device, file, socket)
+  virtual void open() = 0;
+
+  // True for sources that produce samples in real time and can therefore
+  // lose them (dongles, network streams), false for recordings
+  virtual bool live() const { return false; }
+
+  virtual void configure(int sample_rate, int frequency, int gain_db) = 0;
+
+  // Change settings while streaming. Each returns false if the source could
+  // not apply the change (a recording can't be retuned).
+  virtual bool retune(int frequency) = 0;
+  virtual bool set_gain(int gain_db) = 0;
+  virtual bool set_sample_rate(int sample_rate) = 0;
+
+  // Reads at most max_size bytes into dest. Returns the number of bytes read,
+  // 0 means the stream has ended.
+  virtual std::size_t read(uint8_t *dest, std::size_t max_size) = 0;
+
+  // Calls callback with consecutive blocks until stop() is called or the
+  // stream ends. Sources with a cheaper way to hand out blocks than read()
+  // override this, those already own their memory and ignore the buffer
+  // provider.
+  virtual void stream(const BlockCallback &callback) {
+    StreamBuffer buffer(BLOCK_SIZE);
+
+    while (!stop_requested) {
+      std::size_t len = BLOCK_SIZE;
+      uint8_t *dest = buffer_provider ? buffer_provider(len) : nullptr;
+      if (!dest) {
+        dest = buffer.data();
+        len = BLOCK_SIZE;
+      }
+
+      std::size_t bytes_read = read(dest, len);
+      if (bytes_read == 0) {
+        break;
+      }
+      callback(make_block(dest, bytes_read, len));
+    }
+  }
+
+  // False for sources whose stream() calls back on a thread that must not
+  // wait, like librtlsdr's USB event loop. Consumers then drop what they
+  // have no room for instead of waiting for it.
+  virtual bool callback_may_block() const { return true; }
+
+  // Must be set before stream() is called
+  void set_buffer_provider(BufferProvider provider) {
+    buffer_provider = std::move(provider);
+  }
+
+  // Makes stream() return. Safe to call from inside the callback.
+  virtual void stop() { stop_requested = true; }
+
+public:
+  // DEFAULT_BUF_LENGTH in rtl_sdr.c source code
+  static constexpr std::size_t BLOCK_SIZE = 16 * 16384;
+
+protected:
+  // Stamps the next sequence number, sample index and arrival time on a
+  // block. requested is what the source asked its backend for, so short
+  // reads can be told apart from full ones.
+  IQBlock make_block(const uint8_t *data, std::size_t len,
+                     std::size_t requested) {
+    // A dangling I without its Q would shift every following pair
+    std::size_t whole_len = len & ~std::size_t(1);
+
+    IQBlock block{data,
+                  whole_len,
+                  next_sequence++,
+                  next_sample,
+                  std::chrono::steady_clock::now(),
+                  len < requested};
+    next_sample += whole_len / 2;
+    return block;
+  }
+
+  std::atomic<bool> stop_requested{false};
+  BufferProvider buffer_provider;
+
+private:
+  uint64_t next_sequence = 0;
+  uint64_t next_sample = 0;
+};
@@ -0,0 +1,139 @@
+#pragma once
+
+#include "StreamBuffer.hpp"
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <utility>
+
+// size bytes of memory mapped twice back to back: data()[i] and
+// data()[i + size] are the same byte. A ring buffer on top of it can hand
+// out any run of up to size bytes as one contiguous pointer, wherever it
+// starts, so nothing ever has to split a loop or a memcpy at the wrap.
+class MirroredBuffer {
+public:
+  MirroredBuffer() = default;
+
+  // size has to be a multiple of the page size. Follows the StreamBuffer
+  // options: huge pages if size is a multiple of a huge page and the system
+  // has them, locked and pre-faulted if asked.
+  explicit MirroredBuffer(std::size_t size) : buf_size(size) {
+    if (size == 0 || size % page_size() != 0) {
+      throw std::invalid_argument(
+          "MirroredBuffer size has to be a multiple of the page size");
+    }
+
+    bool huge = StreamBuffer::options().huge_pages &&
+                size % StreamBuffer::HUGE_PAGE_SIZE == 0;
+    if (huge && !map(MFD_HUGETLB | (21 << MAP_HUGE_SHIFT),
+                     StreamBuffer::HUGE_PAGE_SIZE)) {
+      StreamBuffer::warn_no_huge_pages();
+      huge = false;
+    }
+    if (!huge && !map(0, page_size())) {
+      throw std::runtime_error(std::string("Failed to map mirrored buffer: ") +
+                               std::strerror(errno));
+    }
+    // Both halves share one set of pages, count and lock it once (with
+    // locking on, MAP_POPULATE already filled both halves' page tables)
+    counted = StreamBuffer::prepare(base, size, huge);
+  }
+
+  ~MirroredBuffer() {
+    if (base) {
+      munmap(base, 2 * buf_size);
+      StreamBuffer::release(counted, buf_size);
+    }
+  }
+
+  MirroredBuffer(const MirroredBuffer &) = delete;
+  MirroredBuffer &operator=(const MirroredBuffer &) = delete;
+
+  MirroredBuffer(MirroredBuffer &&other) noexcept
+      : base(std::exchange(other.base, nullptr)),
+        buf_size(std::exchange(other.buf_size, 0)),
+        counted(std::exchange(other.counted, 0)) {}
+
+  MirroredBuffer &operator=(MirroredBuffer &&other) noexcept {
+    std::swap(base, other.base);
+    std::swap(buf_size, other.buf_size);
+    std::swap(counted, other.counted);
+    return *this;
+  }
+
+  // Valid for 2 * size() bytes
+  uint8_t *data() const { return base; }
+  std::size_t size() const { return buf_size; }
+
+  static std::size_t page_size() {
+    return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  }
+
+private:
+  // Maps the memfd twice into a reservation aligned to the page size the
+  // memfd uses. Leaves errno set on failure.
+  bool map(unsigned int memfd_flags, std::size_t align) {
+    int fd = memfd_create("aether-ring", MFD_CLOEXEC | memfd_flags);
+    if (fd < 0) {
+      return false;
+    }
+    if (ftruncate(fd, static_cast<off_t>(buf_size)) != 0) {
+      int err = errno;
+      ::close(fd);
+      errno = err;
+      return false;
+    }
+
+    // Reserve twice the address space plus room to align it, then put the
+    // same pages in both halves
+    std::size_t reserved = 2 * buf_size + align - page_size();
+    void *addr = mmap(nullptr, reserved, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      int err = errno;
+      ::close(fd);
+      errno = err;
+      return false;
+    }
+    uint8_t *start = static_cast<uint8_t *>(addr);
+    uint8_t *aligned = reinterpret_cast<uint8_t *>(
+        (reinterpret_cast<uintptr_t>(start) + align - 1) & ~(align - 1));
+    // Hand back the slack on both sides
+    if (aligned != start) {
+      munmap(start, aligned - start);
+    }
+    std::size_t tail = start + reserved - (aligned + 2 * buf_size);
+    if (tail != 0) {
+      munmap(aligned + 2 * buf_size, tail);
+    }
+
+    for (int half = 0; half < 2; half++) {
+      void *mapped = mmap(aligned + half * buf_size, buf_size,
+                          PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_FIXED | StreamBuffer::map_flags(),
+                          fd, 0);
+      if (mapped == MAP_FAILED) {
+        int err = errno;
+        ::close(fd);
+        munmap(aligned, 2 * buf_size);
+        errno = err;
+        return false;
+      }
+    }
+
+    // The mappings keep the memory alive
+    ::close(fd);
+    base = aligned;
+    return true;
+  }
+
+  uint8_t *base = nullptr;
+  std::size_t buf_size = 0;
+  // What StreamBuffer::prepare() counted
+  unsigned counted = 0;
+};
@@ -0,0 +1,125 @@
+#pragma once
+
+#include "FileSource.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Replays a capture by mapping the whole file into memory. stream() hands
+// out pointers straight into the mapping, so the only copy left is the one
+// into the consumer queues, and seeking is just moving an offset.
+class MmapSource : public FileSource {
+public:
+  MmapSource(const std::string &path, bool paced = true)
+      : FileSource(path, paced) {}
+
+  ~MmapSource() override {
+    if (mapping) {
+      munmap(mapping, file_size);
+    }
+  }
+
+  void open() override {
+    FileSource::open();
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+      throw std::runtime_error("Cannot map empty or unreadable file " + path);
+    }
+    file_size = static_cast<std::size_t>(st.st_size);
+
+    void *addr = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      throw std::runtime_error("Failed to mmap " + path + ": " +
+                               std::strerror(errno));
+    }
+    mapping = static_cast<uint8_t *>(addr);
+
+    // We mostly read front to back, let the kernel read ahead aggressively
+    madvise(mapping, file_size, MADV_SEQUENTIAL);
+    seek(position.load(std::memory_order_relaxed) / 2);
+  }
+
+  // Jumps to the given complex sample. Can be called before open() and while
+  // streaming.
+  void seek(std::size_t sample_index) {
+    if (!mapping) {
+      position.store(sample_index * 2, std::memory_order_relaxed);
+      return;
+    }
+
+    std::size_t offset = std::min(sample_index * 2, file_size);
+    prefetch(offset);
+    position.store(offset, std::memory_order_relaxed);
+  }
+
+  std::size_t sample_count() const { return file_size / 2; }
+
+  std::size_t read(uint8_t *dest, std::size_t max_size) override {
+    std::size_t offset = position.load(std::memory_order_relaxed);
+    std::size_t len = std::min(max_size, file_size - offset);
+
+    std::memcpy(dest, mapping + offset, len);
+    advance(offset, len);
+
+    if (paced) {
+      pace(len);
+    }
+    return len;
+  }
+
+  void stream(const BlockCallback &callback) override {
+    while (!stop_requested) {
+      std::size_t offset = position.load(std::memory_order_relaxed);
+      std::size_t len = std::min(BLOCK_SIZE, file_size - offset);
+      if (len == 0) {
+        break;
+      }
+
+      if (paced) {
+        pace(len);
+      }
+      callback(make_block(mapping + offset, len, BLOCK_SIZE));
+      advance(offset, len);
+    }
+  }
+
+private:
+  // Moves position past a block unless a seek happened in the meantime
+  void advance(std::size_t offset, std::size_t len) {
+    position.compare_exchange_strong(offset, offset + len,
+                                     std::memory_order_relaxed);
+
+    // Keep at least half a prefetch window ahead of the reader
+    if (offset + len + PREFETCH_SIZE / 2 >=
+        prefetched_until.load(std::memory_order_relaxed)) {
+      prefetch(offset + len);
+    }
+  }
+
+  // Asks the kernel to start reading the window after offset now, so the
+  // consumers never wait on a page fault
+  void prefetch(std::size_t offset) {
+    // madvise needs a page aligned address
+    std::size_t start = offset & ~(PREFETCH_ALIGN - 1);
+    std::size_t len = std::min(PREFETCH_SIZE, file_size - start);
+    madvise(mapping + start, len, MADV_WILLNEED);
+    prefetched_until.store(start + len, std::memory_order_relaxed);
+  }
+
+  static constexpr std::size_t PREFETCH_SIZE = 16 << 20;
+  static constexpr std::size_t PREFETCH_ALIGN = 1 << 16;
+
+  uint8_t *mapping = nullptr;
+  std::size_t file_size = 0;
+  std::atomic<std::size_t> position{0};
+  std::atomic<std::size_t> prefetched_until{0};
+};
@@ -0,0 +1,104 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <limits>
+
+// What a queue went through, see collect_telemetry(). Sizes count elements
+// of the queue (bytes for byte queues).
+struct QueueTelemetry {
+  std::size_t capacity = 0;
+  // Queued right now
+  std::size_t fill = 0;
+  // Most and fewest queued since the last snapshot
+  std::size_t high_water = 0;
+  std::size_t low_water = 0;
+  // Times the producer had to wait for room, and for how long in total
+  uint64_t full_waits = 0;
+  std::chrono::nanoseconds full_wait_time{0};
+  // Reads that found the queue empty
+  uint64_t empty_pops = 0;
+  // Elements lost because the queue was full (lossy pushes, or lossy
+  // readers that fell behind)
+  uint64_t dropped = 0;
+};
+
+// The counters are cheap enough to leave on. Each has one writer (the side
+// the struct belongs to), so an update is a relaxed load and store instead
+// of a locked read-modify-write, and the queues keep each struct on its
+// owner's cache line. Other threads only load them, apart from the water
+// mark restart in collect_telemetry().
+//
+// The water marks are sampled whenever a side re-reads the other side's
+// index. That happens exactly when its cached copy says the queue is close
+// to full (producer) or empty (consumer), so the marks are exact where they
+// matter without adding any cross-core traffic.
+
+namespace telemetry_detail {
+inline void bump(std::atomic<uint64_t> &counter, uint64_t n) {
+  counter.store(counter.load(std::memory_order_relaxed) + n,
+                std::memory_order_relaxed);
+}
+} // namespace telemetry_detail
+
+struct ProducerTelemetry {
+  void note_fill(std::size_t fill) {
+    if (fill > high_water.load(std::memory_order_relaxed)) {
+      high_water.store(fill, std::memory_order_relaxed);
+    }
+  }
+
+  void note_wait(std::chrono::nanoseconds waited) {
+    telemetry_detail::bump(full_waits, 1);
+    telemetry_detail::bump(full_wait_ns,
+                           static_cast<uint64_t>(waited.count()));
+  }
+
+  void note_dropped(std::size_t n) { telemetry_detail::bump(dropped, n); }
+
+  std::atomic<std::size_t> high_water{0};
+  std::atomic<uint64_t> full_waits{0};
+  std::atomic<uint64_t> full_wait_ns{0};
+  std::atomic<uint64_t> dropped{0};
+};
+
+struct ConsumerTelemetry {
+  void note_fill(std::size_t fill) {
+    if (fill < low_water.load(std::memory_order_relaxed)) {
+      low_water.store(fill, std::memory_order_relaxed);
+    }
+  }
+
+  void note_empty() { telemetry_detail::bump(empty_pops, 1); }
+
+  std::atomic<std::size_t> low_water{std::numeric_limits<std::size_t>::max()};
+  std::atomic<uint64_t> empty_pops{0};
+};
+
+// Snapshot for a monitoring thread. Restarts the water marks, so there
+// should only be one such thread per queue. A producer that samples a mark
+// just as it is restarted can carry it into the new window, which only
+// makes that window's mark a little pessimistic.
+inline QueueTelemetry collect_telemetry(ProducerTelemetry &producer,
+                                        ConsumerTelemetry &consumer,
+                                        std::size_t capacity,
+                                        std::size_t fill) {
+  QueueTelemetry t;
+  t.capacity = capacity;
+  t.fill = fill;
+  // A window that never got near full or empty saw at least the fill now
+  t.high_water = std::max(
+      fill, producer.high_water.exchange(0, std::memory_order_relaxed));
+  t.low_water = std::min(
+      fill, consumer.low_water.exchange(std::numeric_limits<std::size_t>::max(),
+                                        std::memory_order_relaxed));
+  t.full_waits = producer.full_waits.load(std::memory_order_relaxed);
+  t.full_wait_time = std::chrono::nanoseconds(
+      producer.full_wait_ns.load(std::memory_order_relaxed));
+  t.empty_pops = consumer.empty_pops.load(std::memory_order_relaxed);
+  t.dropped = producer.dropped.load(std::memory_order_relaxed);
+  return t;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+
+enum class WaitStrategy {
+  // Busy-polls with a pause instruction, then yields. Never sleeps in the
+  // kernel: lowest latency, but the waiting core stays busy.
+  SPIN_YIELD,
+  // Sleeps on a futex. The other side only makes the wake-up syscall when
+  // someone is waiting and the amount they wait for has become available.
+  BLOCK,
+};
+
+// One side of a queue waiting for the other, e.g. a consumer waiting for
+// data. The waiting thread calls wait(), the other thread calls notify()
+// after every change that could satisfy it.
+class QueueWaiter {
+public:
+  // Waits until ready() is true, for at most timeout. amount is what ready()
+  // waits for, notify() only wakes us once at least that much is there.
+  // Returns ready() at the end.
+  template <typename Ready>
+  bool wait(std::size_t amount, Ready ready, std::chrono::nanoseconds timeout,
+            WaitStrategy strategy) {
+    using clock = std::chrono::steady_clock;
+
+    if (ready()) {
+      return true;
+    }
+    auto deadline = clock::now() + timeout;
+
+    if (strategy == WaitStrategy::SPIN_YIELD) {
+      for (int spins = 0;; spins++) {
+        if (ready()) {
+          return true;
+        }
+        if (spins < SPIN_LIMIT) {
+          cpu_relax();
+        } else if (clock::now() >= deadline) {
+          return false;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    }
+
+    while (true) {
+      uint32_t seen = sequence.load(std::memory_order_acquire);
+      wanted.store(amount, std::memory_order_relaxed);
+      // Pairs with the fence in notify(): either we see the other side's
+      // update below, or it sees wanted and bumps sequence
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+
+      if (ready()) {
+        wanted.store(0, std::memory_order_relaxed);
+        return true;
+      }
+
+      auto now = clock::now();
+      if (now >= deadline) {
+        wanted.store(0, std::memory_order_relaxed);
+        return false;
+      }
+      // Returns right away if sequence moved since we read it
+      futex_wait(seen, deadline - now);
+    }
+  }
+
+  // available is how much the waiter would see now, an overestimate only
+  // costs a spurious wake-up
+  void notify(std::size_t available) {
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    std::size_t want = wanted.load(std::memory_order_relaxed);
+    if (want == 0 || available < want) {
+      return;
+    }
+
+    // Only the first notify after a waiter arrives pays for the syscall
+    wanted.store(0, std::memory_order_relaxed);
+    sequence.fetch_add(1, std::memory_order_release);
+    syscall(SYS_futex, futex_word(), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr,
+            0);
+  }
+
+private:
+  void futex_wait(uint32_t seen, std::chrono::nanoseconds timeout) {
+    auto ns = timeout.count();
+    timespec ts{static_cast<time_t>(ns / 1000000000),
+                static_cast<long>(ns % 1000000000)};
+    syscall(SYS_futex, futex_word(), FUTEX_WAIT_PRIVATE, seen, &ts, nullptr,
+            0);
+  }
+
+  uint32_t *futex_word() { return reinterpret_cast<uint32_t *>(&sequence); }
+
+  static void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+  }
+
+  // ~a few microseconds of pausing before we start yielding
+  static constexpr int SPIN_LIMIT = 1000;
+
+  static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t),
+                "futex needs a plain 32-bit word");
+
+  // Bumped on every wake-up, the futex word
+  std::atomic<uint32_t> sequence{0};
+  // Amount the waiter is waiting for, 0 when nobody waits
+  std::atomic<std::size_t> wanted{0};
+};
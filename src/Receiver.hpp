@@ -0,0 +1,492 @@
+#pragma once
+
+#include "AudioProcessor.hpp"
+#include "BlockPool.hpp"
+#include "BroadcastRing.hpp"
+#include "ControlChannel.hpp"
+#include "IQSource.hpp"
+#include "RtlTcpServer.hpp"
+#include "SigMFRecorder.hpp"
+#include "StreamBuffer.hpp"
+#include "TripleBuffer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <pthread.h>
+#include <sched.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Counters written by the producer with relaxed atomics and read by anyone
+// who wants to report them
+struct ReceiverStats {
+  std::atomic<uint64_t> bytes{0};
+  std::atomic<uint64_t> blocks{0};
+  // Sequence number of the last block the producer handled
+  std::atomic<uint64_t> last_sequence{0};
+  // Blocks the source delivered with fewer bytes than requested
+  std::atomic<uint64_t> short_blocks{0};
+  // Blocks that arrived more than LATE_FACTOR block durations after the
+  // previous one (live sources only)
+  std::atomic<uint64_t> late_blocks{0};
+  // Samples the sample clock says the dongle produced but we never got
+  // (live sources only)
+  std::atomic<uint64_t> samples_lost{0};
+  // Times samples_lost went up
+  std::atomic<uint64_t> loss_events{0};
+  // Times the producer had to wait for the audio reader to free room
+  std::atomic<uint64_t> audio_stalls{0};
+  // Blocks dropped because the ring was full and the source can't wait
+  // (async dongles), their samples also count as lost
+  std::atomic<uint64_t> ring_drops{0};
+  // Bytes the recorder and server missed because every pool block was
+  // still in use
+  std::atomic<uint64_t> pool_dropped_bytes{0};
+};
+
+// The newest spectrum of a receiver, see Receiver::spectrum
+struct SpectrumFrame {
+  static constexpr std::size_t BINS = 1024;
+
+  // Raw IQ the FFT was taken over, iq_len bytes of it are valid (none until
+  // the first frame)
+  std::vector<uint8_t> iq = std::vector<uint8_t>(2 * BINS);
+  std::size_t iq_len = 0;
+  // fft-shifted magnitudes in dB
+  std::vector<float> magnitudes = std::vector<float>(BINS);
+};
+
+// Everything that belongs to one input: the source, its producer thread, its
+// ring and its demodulator. Several receivers can run side by side, one
+// per dongle.
+class Receiver {
+public:
+  Receiver(const std::string &label, std::unique_ptr<IQSource> source,
+           int sample_rate, int frequency, int gain_db, int decimation_rate)
+      : label(label), sample_rate(sample_rate), frequency(frequency),
+        gain_db(gain_db), source(std::move(source)),
+        // At least one huge page, if huge pages were asked for
+        ring(std::max(QUEUE_SIZE, StreamBuffer::granule())),
+        audio_reader(ring.add_reader(BroadcastRing::LOSSLESS)),
+        gui_reader(ring.add_reader(BroadcastRing::LOSSY)),
+        AP(decimation_rate) {}
+
+  // Also when main unwinds after start() threw somewhere else, a joinable
+  // producer would take the process down with std::terminate
+  ~Receiver() { join(); }
+
+  Receiver(const Receiver &) = delete;
+  Receiver &operator=(const Receiver &) = delete;
+
+  // How the producer waits for room in the ring. Call before start().
+  void set_wait_strategy(WaitStrategy strategy) {
+    ring.set_wait_strategy(strategy);
+  }
+
+  // Starts the producer, pinned to core if it is not negative. recorder and
+  // server have to be set up before.
+  void start(std::atomic<bool> &running, int core = -1) {
+    if (recorder || server) {
+      std::size_t blocks = POOL_SLACK_BLOCKS;
+      blocks += recorder ? recorder->max_blocks() : 0;
+      blocks += server ? server->max_blocks() : 0;
+      pool = std::make_unique<BlockPool>(blocks);
+    }
+    producer = std::thread(&Receiver::producer_thread, this, std::ref(running),
+                           core);
+  }
+
+  // Stops the source and waits for the producer. The producer notices
+  // running going false on its next block, but a source that has gone
+  // quiet (a silent rtl_tcp server) may never deliver one. Doesn't need
+  // running to be false, so the producer also stops when nobody drains the
+  // ring anymore.
+  void join() {
+    if (producer.joinable()) {
+      stopping.store(true, std::memory_order_relaxed);
+      source->stop();
+      producer.join();
+    }
+  }
+
+  // Consumer side reads that first throw away anything queued before the
+  // last retune. The audio side demodulates in place, peek_audio() then
+  // consume_audio().
+  BroadcastRing::ReadRegion peek_audio(size_t max_size) {
+    ring.discard_until(audio_reader,
+                       stale_until.load(std::memory_order_acquire));
+    return ring.peek(audio_reader, max_size);
+  }
+
+  void consume_audio(size_t len) { ring.consume(audio_reader, len); }
+
+  size_t pop_gui(uint8_t *dest, size_t max_size) {
+    ring.discard_until(gui_reader, stale_until.load(std::memory_order_acquire));
+    // The display only cares about the newest samples
+    ring.skip_to_latest(gui_reader, max_size);
+    return ring.pop(gui_reader, dest, max_size);
+  }
+
+  // Ring counters as the audio callback and the GUI see them, for the stats
+  // thread. The GUI's dropped bytes are the ones it missed by falling a
+  // whole ring behind.
+  QueueTelemetry audio_telemetry() { return ring.telemetry(audio_reader); }
+  QueueTelemetry gui_telemetry() { return ring.telemetry(gui_reader); }
+
+  // Bumped by the producer after every applied retune, consumers compare it
+  // to the last value they saw to know when to reset their state
+  uint32_t tuning() const {
+    return tuning_generation.load(std::memory_order_acquire);
+  }
+
+  std::string label;
+  // Current settings, written by the producer when it applies a request
+  std::atomic<int> sample_rate;
+  std::atomic<int> frequency;
+  std::atomic<int> gain_db;
+
+  // Requests for the producer, see ControlChannel
+  ControlChannel control;
+
+  std::unique_ptr<IQSource> source;
+  // The one copy of the stream the audio callback (lossless, the producer
+  // waits for it) and the GUI (lossy) read from. Mirrored, so direct reads
+  // and in-place demodulation never get split at the wrap.
+  BroadcastRing ring;
+  BroadcastRing::ReaderId audio_reader;
+  BroadcastRing::ReaderId gui_reader;
+  AudioProcessor AP;
+  // Written by the spectrum thread from the GUI reader, read by the GUI
+  TripleBuffer<SpectrumFrame> spectrum;
+
+  // Blocks for the consumers below, declared first so it outlives them
+  std::unique_ptr<BlockPool> pool;
+  // Optional extra consumers, they get the stream as pool blocks
+  std::unique_ptr<SigMFRecorder> recorder;
+  std::unique_ptr<RtlTcpServer> server;
+
+  ReceiverStats stats;
+
+private:
+  void producer_thread(std::atomic<bool> &running, int core) {
+    if (core >= 0) {
+      cpu_set_t cpus;
+      CPU_ZERO(&cpus);
+      CPU_SET(core, &cpus);
+      if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+        std::cerr << "Warning: Failed to pin producer " << label
+                  << " to core " << core << "\n";
+      }
+    }
+
+    bool live = source->live();
+    bool may_block = source->callback_may_block();
+    // Arrival time of sample clock_base_sample, the loss check compares the
+    // samples we got since then against what sample_rate promises
+    std::chrono::steady_clock::time_point clock_base;
+    uint64_t clock_base_sample = 0;
+    std::chrono::steady_clock::time_point last_arrival;
+    bool first = true;
+
+    // Sources that stream through read() fill the ring in place, the
+    // block then only has to be committed instead of copied
+    uint8_t *reserved = nullptr;
+    source->set_buffer_provider([&](std::size_t &len) -> uint8_t * {
+      reserved = reserve_audio(running, len);
+      return reserved;
+    });
+
+    source->stream([&](const IQBlock &block) {
+      if (!keep_running(running)) {
+        source->stop();
+        return;
+      }
+
+      const uint8_t *data = block.data;
+      std::size_t len = block.len;
+
+      stats.bytes.fetch_add(len, std::memory_order_relaxed);
+      stats.blocks.fetch_add(1, std::memory_order_relaxed);
+      stats.last_sequence.store(block.sequence, std::memory_order_relaxed);
+      if (block.short_read) {
+        stats.short_blocks.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      bool in_place = reserved && block.data == reserved;
+      reserved = nullptr;
+
+      if (apply_control()) {
+        // The block in hand was sampled at the old settings, and the tuner
+        // needs a moment to settle
+        settle_bytes = 2 * static_cast<std::size_t>(
+                               sample_rate.load(std::memory_order_relaxed) *
+                               RETUNE_SETTLE_SECONDS);
+        first = true;
+        return;
+      }
+
+      if (live) {
+        if (first) {
+          clock_base = block.timestamp;
+          clock_base_sample = block.first_sample;
+          first = false;
+        } else {
+          account_timing(block, last_arrival, clock_base, clock_base_sample);
+        }
+        last_arrival = block.timestamp;
+      }
+
+      if (settle_bytes > 0) {
+        std::size_t skip = std::min(settle_bytes, len);
+        settle_bytes -= skip;
+        data += skip;
+        len -= skip;
+        if (len == 0) {
+          return;
+        }
+        if (in_place) {
+          // Rare, only right after a retune. The queue can only publish from
+          // the start of the reservation, move the keepers there.
+          std::memmove(const_cast<uint8_t *>(block.data), data, len);
+          data = block.data;
+        }
+      }
+
+      if (in_place) {
+        ring.commit(len);
+      } else if (!ring.push(data, len)) {
+        if (!may_block) {
+          // Waiting would only move the loss into librtlsdr, where the
+          // dongle's transfers aren't resubmitted and nobody counts it
+          stats.ring_drops.fetch_add(1, std::memory_order_relaxed);
+          stats.samples_lost.fetch_add(len / 2, std::memory_order_relaxed);
+          stats.loss_events.fetch_add(1, std::memory_order_relaxed);
+        } else {
+          stats.audio_stalls.fetch_add(1, std::memory_order_relaxed);
+
+          // Sleeps until the audio callback has made room
+          while (keep_running(running) && !ring.push(data, len)) {
+            ring.wait_for_space(len, WAIT_SLICE);
+          }
+        }
+      }
+
+      if (pool) {
+        fan_out(block, data, len);
+      }
+    });
+
+    if (pool) {
+      // The tail of the stream
+      publish_filling();
+    }
+
+    std::cout << "Producer " << label << " stopped.\n";
+  }
+
+  // main's flag, and join()'s
+  bool keep_running(const std::atomic<bool> &running) const {
+    return running && !stopping.load(std::memory_order_relaxed);
+  }
+
+  // Waits for len bytes of room in the ring and returns where they
+  // start, lowering len if the room is cut short by the end of the ring.
+  // Returns nullptr if too little is contiguous to be worth a direct read.
+  uint8_t *reserve_audio(std::atomic<bool> &running, std::size_t &len) {
+    BroadcastRing::WriteRegion region = ring.reserve(len);
+    if (region.size() < len) {
+      stats.audio_stalls.fetch_add(1, std::memory_order_relaxed);
+
+      while (keep_running(running) && region.size() < len) {
+        ring.wait_for_space(len, WAIT_SLICE);
+        region = ring.reserve(len);
+      }
+    }
+
+    std::size_t contiguous = region.first_len & ~(DIRECT_READ_ALIGN - 1);
+    if (contiguous < MIN_DIRECT_READ) {
+      return nullptr;
+    }
+    len = contiguous;
+    return region.first;
+  }
+
+  // Applies whatever the control channel has pending. Returns true if the
+  // tuning changed, in which case everything already queued is marked stale
+  // and every consumer is told through tuning_generation.
+  bool apply_control() {
+    ControlChannel::Request request;
+    uint32_t changes = control.take(request);
+    if (changes == 0) {
+      return false;
+    }
+
+    bool changed = false;
+    if (changes & ControlChannel::SAMPLE_RATE) {
+      if (recorder) {
+        // SigMF has one sample rate per recording
+        std::cerr << "Warning: Cannot change the sample rate while recording\n";
+      } else if (request.sample_rate < TARGET_AUDIO_RATE) {
+        std::cerr << "Warning: Sample rate " << request.sample_rate
+                  << " Hz is below the audio rate\n";
+      } else if (source->set_sample_rate(request.sample_rate)) {
+        sample_rate.store(request.sample_rate, std::memory_order_relaxed);
+        changed = true;
+      }
+    }
+    if ((changes & ControlChannel::FREQUENCY) &&
+        source->retune(request.frequency)) {
+      frequency.store(request.frequency, std::memory_order_relaxed);
+      changed = true;
+    }
+    if ((changes & ControlChannel::GAIN) && source->set_gain(request.gain_db)) {
+      // Same station, nothing downstream has to start over
+      gain_db.store(request.gain_db, std::memory_order_relaxed);
+    }
+
+    if (!changed) {
+      return false;
+    }
+
+    // A block only ever holds samples from one tuning
+    if (pool) {
+      publish_filling();
+    }
+
+    // Nothing has been pushed at the new settings yet, so everything up to
+    // the current write position is stale
+    stale_until.store(ring.write_position(), std::memory_order_release);
+    tuning_generation.fetch_add(1, std::memory_order_release);
+    return true;
+  }
+
+  // Copies the samples into pool blocks for the recorder and the server,
+  // which get descriptors instead of copies of their own. Source blocks
+  // are packed together until a pool block is full, so the small ones a
+  // network source delivers don't eat up the pool. That means consumers
+  // get the stream one pool block (~55 ms at 2.4 Msps) at a time, the same
+  // as from a real rtl_tcp.
+  void fan_out(const IQBlock &block, const uint8_t *data, std::size_t len) {
+    // The settle skip may have cut off the front of the block
+    uint64_t first_sample = block.first_sample + (block.len - len) / 2;
+
+    while (len > 0) {
+      if (!filling) {
+        filling = pool->acquire();
+        if (!filling) {
+          stats.pool_dropped_bytes.fetch_add(len, std::memory_order_relaxed);
+          if (recorder) {
+            recorder->count_dropped(len);
+          }
+          if (server) {
+            server->count_dropped(len);
+          }
+          return;
+        }
+        filling_info = BlockRef{};
+        filling_info.sequence = block.sequence;
+        filling_info.first_sample = first_sample;
+        filling_info.timestamp = block.timestamp;
+        filling_info.frequency = frequency.load(std::memory_order_relaxed);
+      }
+
+      std::size_t n = std::min(len, pool->block_size() - filling_info.len);
+      std::memcpy(filling + filling_info.len, data, n);
+      filling_info.len += n;
+      data += n;
+      len -= n;
+      first_sample += n / 2;
+
+      if (filling_info.len == pool->block_size()) {
+        publish_filling();
+      }
+    }
+  }
+
+  // Hands the block being filled to the consumers, if there is one
+  void publish_filling() {
+    if (!filling) {
+      return;
+    }
+    filling = nullptr;
+    if (filling_info.len == 0) {
+      // Never handed out, still free
+      return;
+    }
+
+    uint32_t consumers = (recorder ? 1 : 0) + (server ? 1 : 0);
+    BlockRef block = pool->publish(filling_info, consumers);
+    if (recorder) {
+      recorder->push(block);
+    }
+    if (server) {
+      server->push(block);
+    }
+  }
+
+  // Late and lost sample bookkeeping for live sources
+  void account_timing(const IQBlock &block,
+                      std::chrono::steady_clock::time_point last_arrival,
+                      std::chrono::steady_clock::time_point &clock_base,
+                      uint64_t &clock_base_sample) {
+    double gap =
+        std::chrono::duration<double>(block.timestamp - last_arrival).count();
+    double rate = sample_rate.load(std::memory_order_relaxed);
+    double block_duration = static_cast<double>(block.samples()) / rate;
+    if (gap > LATE_FACTOR * block_duration) {
+      stats.late_blocks.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // The dongle keeps sampling whether or not we keep up. If the samples
+    // we received fall behind the wall clock by more than the buffering
+    // between us and the hardware can explain, the difference was dropped.
+    double elapsed =
+        std::chrono::duration<double>(block.timestamp - clock_base).count();
+    double expected = elapsed * rate;
+    double received =
+        static_cast<double>(block.first_sample - clock_base_sample);
+    double deficit = expected - received;
+    if (deficit > LOSS_THRESHOLD_SECONDS * rate) {
+      stats.samples_lost.fetch_add(static_cast<uint64_t>(deficit),
+                                   std::memory_order_relaxed);
+      stats.loss_events.fetch_add(1, std::memory_order_relaxed);
+      clock_base = block.timestamp;
+      clock_base_sample = block.first_sample;
+    }
+  }
+
+  static constexpr std::size_t QUEUE_SIZE = 1 << 20;
+  // Pool blocks on top of what the consumers hold: the one being filled
+  // and some headroom for releases that are on their way
+  static constexpr std::size_t POOL_SLACK_BLOCKS = 4;
+  // USB bulk transfers come in 512 byte packets, reads into the queue are
+  // kept to whole packets
+  static constexpr std::size_t DIRECT_READ_ALIGN = 512;
+  static constexpr std::size_t MIN_DIRECT_READ = 16384;
+  // Longest the producer sleeps on a full ring before it checks
+  // running again
+  static constexpr std::chrono::milliseconds WAIT_SLICE{50};
+  static constexpr double LATE_FACTOR = 2.0;
+  // More than the 15 async USB transfers hold at 2.4 Msps (~0.8 s), so
+  // catching up on a backlog doesn't look like a loss
+  static constexpr double LOSS_THRESHOLD_SECONDS = 1.0;
+  // PLL lock plus whatever the dongle's FIFO still holds
+  static constexpr double RETUNE_SETTLE_SECONDS = 0.01;
+
+  std::atomic<std::size_t> stale_until{0};
+  std::atomic<uint32_t> tuning_generation{0};
+  // Producer only
+  std::size_t settle_bytes = 0;
+  // Pool block being filled for fan_out() and what it holds so far
+  uint8_t *filling = nullptr;
+  BlockRef filling_info{};
+
+  std::thread producer;
+  std::atomic<bool> stopping{false};
+};
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Wire format of rtl_tcp (rtl_tcp.c in librtlsdr). After connecting, the
+// server sends a 12 byte dongle info header followed by the raw unsigned
+// 8-bit IQ stream. Clients control the dongle with 5 byte commands.
+namespace rtl_tcp {
+
+static constexpr uint16_t DEFAULT_PORT = 1234;
+
+static constexpr std::size_t HEADER_SIZE = 12;
+static constexpr std::size_t COMMAND_SIZE = 5;
+
+enum Command : uint8_t {
+  SET_FREQUENCY = 0x01,
+  SET_SAMPLE_RATE = 0x02,
+  SET_GAIN_MODE = 0x03,
+  SET_GAIN = 0x04, // Tenths of a dB
+};
+
+struct DongleInfo {
+  uint32_t tuner_type;
+  uint32_t gain_count;
+};
+
+inline void encode_header(const DongleInfo &info, uint8_t *out) {
+  uint32_t tuner_type = htonl(info.tuner_type);
+  uint32_t gain_count = htonl(info.gain_count);
+  std::memcpy(out, "RTL0", 4);
+  std::memcpy(out + 4, &tuner_type, 4);
+  std::memcpy(out + 8, &gain_count, 4);
+}
+
+// Returns false if the magic doesn't match
+inline bool parse_header(const uint8_t *in, DongleInfo &info) {
+  if (std::memcmp(in, "RTL0", 4) != 0) {
+    return false;
+  }
+  uint32_t tuner_type;
+  uint32_t gain_count;
+  std::memcpy(&tuner_type, in + 4, 4);
+  std::memcpy(&gain_count, in + 8, 4);
+  info.tuner_type = ntohl(tuner_type);
+  info.gain_count = ntohl(gain_count);
+  return true;
+}
+
+inline void encode_command(uint8_t cmd, uint32_t param, uint8_t *out) {
+  uint32_t be_param = htonl(param);
+  out[0] = cmd;
+  std::memcpy(out + 1, &be_param, 4);
+}
+
+} // namespace rtl_tcp
@@ -0,0 +1,400 @@
+#pragma once
+
+#include "BlockPool.hpp"
+#include "RtlTcp.hpp"
+#include "SPSCQueue.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <iostream>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+// Serves the raw IQ stream to any number of rtl_tcp clients. The producer
+// does a single non-blocking push of a pool block into the server's queue;
+// the server thread queues a reference to each block per client, so
+// fan-out costs no copies at all. All sockets are non-blocking and
+// driven by epoll, a client whose backlog grows past MAX_CLIENT_BACKLOG is
+// disconnected so it can never stall anyone else.
+class RtlTcpServer {
+public:
+  RtlTcpServer(uint16_t port, const rtl_tcp::DongleInfo &info)
+      : queue(QUEUE_SIZE), port(port), info(info) {}
+
+  ~RtlTcpServer() { stop(); }
+
+  RtlTcpServer(const RtlTcpServer &) = delete;
+  RtlTcpServer &operator=(const RtlTcpServer &) = delete;
+
+  void start() {
+    listen_sock = ::socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_sock < 0) {
+      throw std::runtime_error("Failed to create server socket");
+    }
+
+    int one = 1;
+    int zero = 0;
+    setsockopt(listen_sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // Accept IPv4 clients on the same socket
+    setsockopt(listen_sock, IPPROTO_IPV6, IPV6_V6ONLY, &zero, sizeof(zero));
+
+    sockaddr_in6 addr{};
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+    if (::bind(listen_sock, reinterpret_cast<sockaddr *>(&addr),
+               sizeof(addr)) != 0 ||
+        ::listen(listen_sock, 16) != 0) {
+      ::close(listen_sock);
+      throw std::runtime_error("Failed to listen on port " +
+                               std::to_string(port) + ": " +
+                               std::strerror(errno));
+    }
+
+    epoll_fd = epoll_create1(0);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = listen_sock;
+    if (epoll_fd < 0 ||
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_sock, &ev) != 0) {
+      std::string error = std::strerror(errno);
+      if (epoll_fd >= 0) {
+        ::close(epoll_fd);
+      }
+      ::close(listen_sock);
+      throw std::runtime_error("Failed to set up epoll for the server: " +
+                               error);
+    }
+
+    serving = true;
+    server = std::thread(&RtlTcpServer::server_thread, this);
+
+    std::cout << "rtl_tcp server listening on port " << port << "\n";
+  }
+
+  void stop() {
+    if (!serving) {
+      return;
+    }
+    serving = false;
+    server.join();
+
+    for (auto &entry : clients) {
+      release_all(entry.second);
+      ::close(entry.first);
+    }
+    clients.clear();
+    BlockRef block;
+    while (queue.pop(&block, 1) != 0) {
+      BlockPool::release(block);
+    }
+    ::close(epoll_fd);
+    ::close(listen_sock);
+  }
+
+  // Called from the producer thread, never blocks. Takes over one reference
+  // to the block.
+  void push(const BlockRef &block) {
+    if (!queue.push(block)) {
+      BlockPool::release(block);
+      count_dropped(block.len);
+    }
+  }
+
+  // Producer thread: len bytes that never made it into a block
+  void count_dropped(std::size_t len) {
+    dropped_bytes.fetch_add(len, std::memory_order_relaxed);
+  }
+
+  // Most blocks the server holds at once, for sizing the pool. Clients
+  // share their blocks, so together they hold about one backlog's worth.
+  std::size_t max_blocks() const {
+    return queue.capacity() + MAX_CLIENT_BACKLOG / IQSource::BLOCK_SIZE + 2;
+  }
+
+  std::size_t client_count() const {
+    return num_clients.load(std::memory_order_relaxed);
+  }
+
+  // For the stats thread
+  QueueTelemetry queue_telemetry() { return queue.telemetry(); }
+
+private:
+  struct Client {
+    // One reference each
+    std::deque<BlockRef> chunks;
+    // Bytes of chunks.front() already sent
+    std::size_t offset = 0;
+    std::size_t backlog = 0;
+    bool want_write = false;
+    bool too_slow = false;
+
+    // Partially received command
+    uint8_t command[rtl_tcp::COMMAND_SIZE];
+    std::size_t command_fill = 0;
+    // Commands received, none of them is applied
+    std::size_t ignored_commands = 0;
+  };
+
+  void server_thread() {
+    epoll_event events[64];
+
+    while (serving) {
+      // Short timeout, new samples arrive through the queue and not through
+      // a file descriptor
+      int n = epoll_wait(epoll_fd, events, 64, POLL_INTERVAL_MS);
+
+      for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd == listen_sock) {
+          accept_clients();
+          continue;
+        }
+
+        auto it = clients.find(fd);
+        if (it == clients.end())
+          continue;
+
+        if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+          drop_client(fd, "disconnected");
+          continue;
+        }
+        if ((events[i].events & EPOLLIN) && !read_commands(fd, it->second))
+          continue;
+        if ((events[i].events & EPOLLOUT) && !flush_client(fd, it->second)) {
+          drop_client(fd, "write error");
+        }
+      }
+
+      distribute();
+    }
+  }
+
+  void accept_clients() {
+    while (true) {
+      int fd = ::accept4(listen_sock, nullptr, nullptr, SOCK_NONBLOCK);
+      if (fd < 0)
+        return;
+
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      int sndbuf = SOCKET_BUF_SIZE;
+      setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf));
+
+      uint8_t header[rtl_tcp::HEADER_SIZE];
+      rtl_tcp::encode_header(info, header);
+      if (::send(fd, header, sizeof(header), MSG_NOSIGNAL) !=
+          static_cast<ssize_t>(sizeof(header))) {
+        ::close(fd);
+        continue;
+      }
+
+      epoll_event ev{};
+      ev.events = EPOLLIN;
+      ev.data.fd = fd;
+      if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0) {
+        // We'd never hear from it again
+        std::cerr << "Warning: rtl_tcp client refused, epoll failed: "
+                  << std::strerror(errno) << "\n";
+        ::close(fd);
+        continue;
+      }
+
+      clients.emplace(fd, Client());
+      num_clients.store(clients.size(), std::memory_order_relaxed);
+      std::cout << "rtl_tcp client connected (" << clients.size()
+                << " total)\n";
+    }
+  }
+
+  // Returns false if the client was dropped
+  bool read_commands(int fd, Client &client) {
+    while (true) {
+      ssize_t r = ::recv(fd, client.command + client.command_fill,
+                         rtl_tcp::COMMAND_SIZE - client.command_fill, 0);
+      if (r == 0) {
+        drop_client(fd, "disconnected");
+        return false;
+      }
+      if (r < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+          return true;
+        drop_client(fd, "read error");
+        return false;
+      }
+
+      client.command_fill += static_cast<std::size_t>(r);
+      if (client.command_fill < rtl_tcp::COMMAND_SIZE) {
+        continue;
+      }
+      client.command_fill = 0;
+
+      // The dongle is shared with the local receiver and other clients,
+      // so clients don't get to retune it. Said once, so the user knows
+      // why their tuning does nothing.
+      if (client.ignored_commands++ == 0) {
+        std::cout << "rtl_tcp client command 0x" << std::hex
+                  << static_cast<int>(client.command[0]) << std::dec
+                  << " ignored, the dongle is shared (so are later ones)\n";
+      }
+    }
+  }
+
+  // Queues every block the producer pushed for every client, each client
+  // holding its own reference
+  void distribute() {
+    BlockRef block;
+    bool any = false;
+    while (queue.pop(&block, 1) != 0) {
+      any = true;
+      for (auto &entry : clients) {
+        Client &client = entry.second;
+        if (client.backlog + block.len > MAX_CLIENT_BACKLOG) {
+          client.too_slow = true;
+        }
+        if (client.too_slow) {
+          continue;
+        }
+        BlockPool::retain(block);
+        client.chunks.push_back(block);
+        client.backlog += block.len;
+      }
+      // Only the clients' references are left
+      BlockPool::release(block);
+    }
+    if (!any) {
+      return;
+    }
+
+    // Dropping invalidates the iterators, collect first
+    std::vector<std::pair<int, const char *>> to_drop;
+    for (auto &entry : clients) {
+      Client &client = entry.second;
+      if (client.too_slow) {
+        to_drop.emplace_back(entry.first, "too slow");
+      } else if (!client.want_write && !flush_client(entry.first, client)) {
+        to_drop.emplace_back(entry.first, "write error");
+      }
+    }
+
+    for (auto &entry : to_drop) {
+      drop_client(entry.first, entry.second);
+    }
+  }
+
+  // Sends as much of the backlog as the socket takes. Returns false if the
+  // connection or its epoll registration failed.
+  bool flush_client(int fd, Client &client) {
+    while (!client.chunks.empty()) {
+      iovec iov[MAX_IOV];
+      int iov_count = 0;
+      for (auto it = client.chunks.begin();
+           it != client.chunks.end() && iov_count < MAX_IOV; ++it) {
+        std::size_t skip = iov_count == 0 ? client.offset : 0;
+        iov[iov_count].iov_base = const_cast<uint8_t *>(it->data) + skip;
+        iov[iov_count].iov_len = it->len - skip;
+        iov_count++;
+      }
+
+      msghdr msg{};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = iov_count;
+      ssize_t r = ::sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+      if (r < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+          return set_want_write(fd, client, true);
+        }
+        if (errno == EINTR)
+          continue;
+        return false;
+      }
+
+      // Pop fully sent chunks
+      std::size_t sent = static_cast<std::size_t>(r);
+      client.backlog -= sent;
+      while (sent > 0) {
+        std::size_t left = client.chunks.front().len - client.offset;
+        if (sent < left) {
+          client.offset += sent;
+          break;
+        }
+        sent -= left;
+        client.offset = 0;
+        BlockPool::release(client.chunks.front());
+        client.chunks.pop_front();
+      }
+    }
+
+    return set_want_write(fd, client, false);
+  }
+
+  // Returns false if epoll refused, the client can't be served then
+  bool set_want_write(int fd, Client &client, bool want_write) {
+    if (client.want_write == want_write)
+      return true;
+    client.want_write = want_write;
+
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    if (want_write) {
+      ev.events |= EPOLLOUT;
+    }
+    ev.data.fd = fd;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) == 0;
+  }
+
+  void release_all(Client &client) {
+    for (const BlockRef &block : client.chunks) {
+      BlockPool::release(block);
+    }
+    client.chunks.clear();
+  }
+
+  void drop_client(int fd, const char *reason) {
+    // Nothing else refers to the socket, closing it also takes it out of
+    // the epoll set
+    ::close(fd);
+    std::size_t ignored = clients[fd].ignored_commands;
+    release_all(clients[fd]);
+    clients.erase(fd);
+    num_clients.store(clients.size(), std::memory_order_relaxed);
+    std::cout << "rtl_tcp client " << reason << " (" << clients.size()
+              << " left, " << ignored << " commands ignored)\n";
+  }
+
+  // Blocks, ~0.9 s at 2.4 Msps
+  static constexpr std::size_t QUEUE_SIZE = 16;
+  // ~1.7 s at 2.4 Msps before a client counts as too slow
+  static constexpr std::size_t MAX_CLIENT_BACKLOG = 8 << 20;
+  static constexpr int SOCKET_BUF_SIZE = 1 << 20;
+  static constexpr int POLL_INTERVAL_MS = 5;
+  static constexpr int MAX_IOV = 64;
+
+  SPSCQueue<BlockRef> queue;
+  uint16_t port;
+  rtl_tcp::DongleInfo info;
+
+  int listen_sock = -1;
+  int epoll_fd = -1;
+  // Only touched by the server thread
+  std::unordered_map<int, Client> clients;
+
+  std::atomic<std::size_t> num_clients{0};
+  std::atomic<std::size_t> dropped_bytes{0};
+  std::atomic<bool> serving{false};
+  std::thread server;
+};
@@ -1,62 +1,160 @@
 #pragma once
 
+#include "MirroredBuffer.hpp"
+#include "QueueTelemetry.hpp"
+#include "QueueWaiter.hpp"
 #include <algorithm>
 #include <atomic>
+#include <chrono>
 #include <cstddef>
 #include <cstdint>
 #include <cstring>
 #include <exception>
+#include <iostream>
 #include <stdexcept>
+#include <type_traits>
 #include <vector>
 
-class SPSCQueue {
+// A run of elements in a ring. It is split in two where it wraps around the
+// end of the buffer, second_len is 0 if it doesn't (always for a mirrored
+// ring). Lengths count elements.
+template <typename T> struct RingRegion {
+  T *first;
+  size_t first_len;
+  T *second;
+  size_t second_len;
+
+  size_t size() const { return first_len + second_len; }
+};
+
+// Lock-free single producer, single consumer ring of T. It moves whole
+// elements only, so a queue of IQSample can never split an I/Q pair and a
+// queue of int16_t PCM never half a sample. Sizes, lengths and positions
+// all count elements, not bytes.
+//
+// Each side keeps a copy of the other side's index and only re-reads the
+// real one when the copy runs out. CACHE_INDICES = false re-reads it on
+// every call instead, the way this queue used to work, so benchmarks can
+// show what the copies save.
+template <typename T, bool CACHE_INDICES = true> class SPSCQueue {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "SPSCQueue copies its elements with memcpy");
+
 public:
-  SPSCQueue(std::size_t size)
-      : buffer(size), buf_size(size), mask(size - 1), head(0), tail(0) {
-    if ((size & (size - 1)) != 0) {
+  using WriteRegion = RingRegion<T>;
+  using ReadRegion = RingRegion<const T>;
+
+  // A mirrored queue maps its memory twice back to back (see
+  // MirroredBuffer), so every push, pop and region is one contiguous run
+  // and DSP code can work on ring memory in place. Falls back to a plain
+  // buffer if the mapping fails (size * sizeof(T) has to be a multiple of
+  // the page size).
+  SPSCQueue(std::size_t size, bool mirrored = false)
+      : buf_size(size), mask(size - 1), head(0), tail(0) {
+    if (size == 0 || (size & (size - 1)) != 0) {
       throw std::invalid_argument("SPSCQueue size has to be a power of 2");
     }
+
+    if (mirrored) {
+      try {
+        mirror = MirroredBuffer(size * sizeof(T));
+      } catch (const std::exception &e) {
+        std::cerr << "Warning: No mirrored queue (" << e.what()
+                  << "), using a plain one\n";
+      }
+    }
+
+    // Either way the memory is a fresh mapping, nothing to construct for a
+    // trivially copyable T
+    if (mirror.data()) {
+      storage = reinterpret_cast<T *>(mirror.data());
+      contiguous_end = 2 * size;
+    } else {
+      buffer = StreamBuffer(size * sizeof(T));
+      storage = reinterpret_cast<T *>(buffer.data());
+      contiguous_end = size;
+    }
   }
 
-  bool push(const std::vector<uint8_t> &data) {
-    const size_t data_size = data.size();
+  bool is_mirrored() const { return mirror.data() != nullptr; }
 
-    auto curr_head = head.load(std::memory_order_relaxed);
-    auto curr_tail = tail.load(std::memory_order_acquire);
+  // Most elements the queue holds
+  size_t capacity() const { return buf_size; }
+
+  // How wait_for_data() and wait_for_space() wait. Set it before the queue
+  // is shared between threads.
+  void set_wait_strategy(WaitStrategy new_strategy) {
+    strategy = new_strategy;
+  }
+
+  // Consumer side: waits until at least len elements can be popped, at most
+  // timeout. Returns whether they can.
+  bool wait_for_data(size_t len, std::chrono::nanoseconds timeout) {
+    return data_waiter.wait(
+        len, [&] { return readable(len) >= len; }, timeout, strategy);
+  }
 
-    if (data_size + curr_head - curr_tail > buf_size) {
+  // Producer side: waits until at least len elements can be pushed, at most
+  // timeout. Returns whether they can. Time spent waiting shows up in
+  // telemetry().
+  bool wait_for_space(size_t len, std::chrono::nanoseconds timeout) {
+    if (writable(len) >= len) {
+      return true;
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool ready = space_waiter.wait(
+        len, [&] { return writable(len) >= len; }, timeout, strategy);
+    producer_stats.note_wait(std::chrono::steady_clock::now() - start);
+    return ready;
+  }
+
+  bool push(const std::vector<T> &data) {
+    return push(data.data(), data.size());
+  }
+
+  bool push(const T &element) { return push(&element, 1); }
+
+  // Pushes data_size elements from data_ptr, either all of them or nothing.
+  // A failed push counts as dropped in telemetry(), producers that retry
+  // should wait_for_space() instead.
+  bool push(const T *data_ptr, size_t data_size) {
+    if (writable(data_size) < data_size) {
       // Queue would become full
+      producer_stats.note_dropped(data_size);
       return false;
     }
+    auto curr_head = head.load(std::memory_order_relaxed);
 
     size_t write_index = curr_head & mask;
-    size_t first_chunk = std::min(data_size, buf_size - write_index);
+    size_t first_chunk = std::min(data_size, contiguous_end - write_index);
 
     // Store data
-    std::memcpy(buffer.data() + write_index, data.data(), first_chunk);
+    std::memcpy(storage + write_index, data_ptr, first_chunk * sizeof(T));
 
     // Check if we need to wrap around
     if (first_chunk < data_size) {
-      std::memcpy(buffer.data(), data.data() + first_chunk,
-                  data_size - first_chunk);
+      std::memcpy(storage, data_ptr + first_chunk,
+                  (data_size - first_chunk) * sizeof(T));
     }
 
     // Update head pointer
     head.store(curr_head + data_size, std::memory_order_release);
+    notify_data(curr_head + data_size - cached_tail);
     return true;
   }
 
-  // Reads at most max_size bytes from queue
-  bool pop(std::vector<uint8_t> &dest, size_t max_size) {
-    auto curr_head = head.load(std::memory_order_acquire);
-    auto curr_tail = tail.load(std::memory_order_relaxed);
-
-    if (curr_head == curr_tail) {
+  // Reads at most max_size elements into dest, resized to what was read.
+  // Returns false if the queue was empty.
+  bool pop(std::vector<T> &dest, size_t max_size) {
+    size_t available = readable(max_size);
+    if (available == 0) {
       // Queue is empty
+      consumer_stats.note_empty();
       return false;
     }
 
-    size_t read_size = std::min(max_size, curr_head - curr_tail);
+    auto curr_tail = tail.load(std::memory_order_relaxed);
+    size_t read_size = std::min(max_size, available);
 
     // Prevent dest containing garbage data
     if (dest.size() != read_size) {
@@ -64,54 +162,208 @@ public:
     }
 
     size_t read_index = curr_tail & mask;
-    size_t first_chunk = std::min(read_size, buf_size - read_index);
+    size_t first_chunk = std::min(read_size, contiguous_end - read_index);
 
     // Get data
-    std::memcpy(dest.data(), buffer.data() + read_index, first_chunk);
+    std::memcpy(dest.data(), storage + read_index, first_chunk * sizeof(T));
 
     if (first_chunk < read_size) {
-      std::memcpy(dest.data() + first_chunk, buffer.data(),
-                  read_size - first_chunk);
+      std::memcpy(dest.data() + first_chunk, storage,
+                  (read_size - first_chunk) * sizeof(T));
     }
 
     // Update tail pointer
     tail.store(curr_tail + read_size, std::memory_order_release);
+    notify_space(buf_size - (available - read_size));
     return true;
   }
 
-  size_t pop(uint8_t *dest_ptr, size_t max_size) {
-    auto curr_head = head.load(std::memory_order_acquire);
-    auto curr_tail = tail.load(std::memory_order_relaxed);
-
-    if (curr_head == curr_tail) {
-      return -1; // Queue empty
+  // Reads at most max_size elements to dest_ptr. Returns how many, 0 if the
+  // queue was empty.
+  size_t pop(T *dest_ptr, size_t max_size) {
+    size_t available = readable(max_size);
+    if (available == 0) {
+      consumer_stats.note_empty();
+      return 0;
     }
 
-    size_t read_size = std::min(max_size, curr_head - curr_tail);
+    auto curr_tail = tail.load(std::memory_order_relaxed);
+    size_t read_size = std::min(max_size, available);
     size_t read_index = curr_tail & mask;
-    size_t first_chunk = std::min(read_size, buf_size - read_index);
+    size_t first_chunk = std::min(read_size, contiguous_end - read_index);
 
     // Read until we have read all data we want or until we hit the end of the
     // Buffer
-    std::memcpy(dest_ptr, buffer.data() + read_index, first_chunk);
+    std::memcpy(dest_ptr, storage + read_index, first_chunk * sizeof(T));
 
     // Check if we hit the end of the buffer
     if (first_chunk < read_size) {
       // Copy from start of buffer to correct offset into destination
-      std::memcpy(dest_ptr + first_chunk, buffer.data(),
-                  read_size - first_chunk);
+      std::memcpy(dest_ptr + first_chunk, storage,
+                  (read_size - first_chunk) * sizeof(T));
     }
 
     tail.store(curr_tail + read_size, std::memory_order_release);
+    notify_space(buf_size - (available - read_size));
     return read_size;
   }
 
+  // Zero-copy write side: returns up to max_size elements of room to fill
+  // in place, then commit() publishes what was written. Nothing is visible
+  // to the consumer before commit().
+  WriteRegion reserve(size_t max_size) {
+    size_t len = std::min(max_size, writable(max_size));
+    return region<T>(head.load(std::memory_order_relaxed), len);
+  }
+
+  // Publishes len elements of the last reserve(), at most its size()
+  void commit(size_t len) {
+    auto new_head = head.load(std::memory_order_relaxed) + len;
+    head.store(new_head, std::memory_order_release);
+    notify_data(new_head - cached_tail);
+  }
+
+  // Zero-copy read side: returns up to max_size of the oldest elements in
+  // place. They stay valid until consume() hands them back.
+  ReadRegion peek(size_t max_size) {
+    size_t len = std::min(max_size, readable(max_size));
+    if (len == 0) {
+      consumer_stats.note_empty();
+    }
+    return region<const T>(tail.load(std::memory_order_relaxed), len);
+  }
+
+  // Frees len elements of the last peek(), at most its size()
+  void consume(size_t len) {
+    auto new_tail = tail.load(std::memory_order_relaxed) + len;
+    tail.store(new_tail, std::memory_order_release);
+    notify_space(buf_size - (cached_head - new_tail));
+  }
+
+  // Number of elements available to the consumer. Always reads both indices,
+  // prefer it for occasional checks over the hot path.
+  size_t size() const {
+    return head.load(std::memory_order_acquire) -
+           tail.load(std::memory_order_relaxed);
+  }
+
+  // Total number of elements ever pushed. Producer side, marks a point in the
+  // stream for discard_until().
+  size_t write_position() const {
+    return head.load(std::memory_order_relaxed);
+  }
+
+  // Total number of elements ever popped or discarded. Consumer side.
+  size_t read_position() const {
+    return tail.load(std::memory_order_relaxed);
+  }
+
+  // Drops everything pushed before position, a value write_position()
+  // returned. Consumer side only.
+  size_t discard_until(size_t position) {
+    auto curr_tail = tail.load(std::memory_order_relaxed);
+    // Positions only ever grow, compare through the difference so this
+    // keeps working when they wrap around
+    if (static_cast<std::ptrdiff_t>(position - curr_tail) <= 0) {
+      return 0;
+    }
+    return discard(position - curr_tail);
+  }
+
+  // Counters for monitoring, safe to call from any one thread. Also
+  // restarts the water marks (see collect_telemetry()).
+  QueueTelemetry telemetry() {
+    return collect_telemetry(producer_stats, consumer_stats, buf_size, size());
+  }
+
+  // Drops up to max_size of the oldest elements without copying them. Consumer
+  // side only.
+  size_t discard(size_t max_size) {
+    size_t available = readable(max_size);
+    auto curr_tail = tail.load(std::memory_order_relaxed);
+
+    size_t discard_size = std::min(max_size, available);
+    tail.store(curr_tail + discard_size, std::memory_order_release);
+    notify_space(buf_size - (available - discard_size));
+    return discard_size;
+  }
+
 private:
-  std::vector<uint8_t> buffer;
+  // Producer side: free space as far as the producer knows. The consumer's
+  // tail is only re-read when the cached copy says there isn't room for
+  // wanted elements, so a queue with room never touches the consumer's cache
+  // line.
+  size_t writable(size_t wanted) {
+    size_t curr_head = head.load(std::memory_order_relaxed);
+    size_t space = buf_size - (curr_head - cached_tail);
+    if (!CACHE_INDICES || space < wanted) {
+      cached_tail = tail.load(std::memory_order_acquire);
+      space = buf_size - (curr_head - cached_tail);
+      producer_stats.note_fill(curr_head - cached_tail);
+    }
+    return space;
+  }
+
+  // Consumer side: same with the producer's head
+  size_t readable(size_t wanted) {
+    size_t curr_tail = tail.load(std::memory_order_relaxed);
+    size_t available = cached_head - curr_tail;
+    if (!CACHE_INDICES || available < wanted) {
+      cached_head = head.load(std::memory_order_acquire);
+      available = cached_head - curr_tail;
+      consumer_stats.note_fill(available);
+    }
+    return available;
+  }
+
+  // Wake-ups cost a fence and a relaxed load when nobody waits, spinning
+  // waiters don't need them at all
+  void notify_data(size_t available) {
+    if (strategy == WaitStrategy::BLOCK) {
+      data_waiter.notify(available);
+    }
+  }
+
+  void notify_space(size_t available) {
+    if (strategy == WaitStrategy::BLOCK) {
+      space_waiter.notify(available);
+    }
+  }
+
+  template <typename U>
+  RingRegion<U> region(size_t position, size_t len) const {
+    size_t index = position & mask;
+    size_t first_len = std::min(len, contiguous_end - index);
+    return {storage + index, first_len, storage, len - first_len};
+  }
+
+  // Exactly one of these holds the memory, storage points into it. Only
+  // touched while constructing.
+  StreamBuffer buffer;
+  MirroredBuffer mirror;
+
+  // Never written after construction, so both cores keep this line in
+  // their caches in shared state
+  alignas(64) T *storage;
   std::size_t buf_size;
   size_t mask;
+  // One past the last index a single run may reach: buf_size, or twice
+  // that when mirrored
+  std::size_t contiguous_end;
+  WaitStrategy strategy = WaitStrategy::BLOCK;
 
-  // Align as 64 to avoid false sharing on cache lines
+  // Producer's line: written on every push, read by the consumer only when
+  // its cached_head runs out. The producer's counters share it.
   alignas(64) std::atomic<std::size_t> head;
+  std::size_t cached_tail = 0;
+  ProducerTelemetry producer_stats;
+
+  // Consumer's line, the mirror image
   alignas(64) std::atomic<std::size_t> tail;
+  std::size_t cached_head = 0;
+  ConsumerTelemetry consumer_stats;
+
+  // The consumer waits on data_waiter, the producer on space_waiter
+  alignas(64) QueueWaiter data_waiter;
+  alignas(64) QueueWaiter space_waiter;
 };
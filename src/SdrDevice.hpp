@@ -0,0 +1,172 @@
+#pragma once
+
+#include "IQSource.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <iostream>
+#include <rtl-sdr.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+
+class SdrDevice : public IQSource {
+public:
+  SdrDevice(int index = 0, bool async_mode = false)
+      : index(index), async_mode(async_mode) {}
+
+  ~SdrDevice() override {
+    if (dev) {
+      rtlsdr_close(dev);
+      std::cout << "Device closed safely.\n";
+    }
+  }
+
+  // Disabling copy constructors to avoid double-free
+  SdrDevice(const SdrDevice &) = delete;
+  SdrDevice &operator=(const SdrDevice &) = delete;
+
+  // Index of the device with the given serial number, throws if none
+  static int index_by_serial(const std::string &serial) {
+    int index = rtlsdr_get_index_by_serial(serial.c_str());
+    if (index < 0) {
+      throw std::runtime_error("No RTL-SDR device with serial " + serial);
+    }
+    return index;
+  }
+
+  bool live() const override { return true; }
+
+  // The async callback runs on the libusb event thread, blocking it holds
+  // up the resubmission of every transfer
+  bool callback_may_block() const override { return !async_mode; }
+
+  void open() override {
+    if (rtlsdr_open(&dev, index) != 0) {
+      throw std::runtime_error("Failed to open RTL-SDR device.");
+    }
+    std::cout << "Device opened successfully.\n";
+  }
+
+  void configure(int sample_rate, int frequency, int gain_db) override {
+    int r;
+    std::cout << "Configuring SDR...\n";
+
+    r = rtlsdr_set_sample_rate(dev, sample_rate);
+    if (r < 0)
+      throw std::runtime_error("Failed to set sample rate");
+
+    // Give PLL time to lock
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+    r = rtlsdr_set_tuner_gain_mode(dev, 1);
+    if (r < 0)
+      throw std::runtime_error("Failed to enable manual gain");
+
+    r = rtlsdr_set_tuner_gain(dev, gain_db * 10);
+    if (r < 0)
+      std::cerr << "Warning: Failed to set tuner gain.\n";
+
+    r = rtlsdr_set_center_freq(dev, frequency);
+    if (r < 0)
+      throw std::runtime_error("Failed to set frequency");
+
+    r = rtlsdr_reset_buffer(dev);
+    if (r < 0)
+      throw std::runtime_error("Failed to reset buffer");
+
+    std::cout << "Configuration complete.\n";
+  }
+
+  bool retune(int frequency) override {
+    if (rtlsdr_set_center_freq(dev, frequency) < 0) {
+      std::cerr << "Warning: Failed to set frequency.\n";
+      return false;
+    }
+    return true;
+  }
+
+  bool set_gain(int gain_db) override {
+    if (rtlsdr_set_tuner_gain(dev, gain_db * 10) < 0) {
+      std::cerr << "Warning: Failed to set tuner gain.\n";
+      return false;
+    }
+    return true;
+  }
+
+  bool set_sample_rate(int sample_rate) override {
+    if (rtlsdr_set_sample_rate(dev, sample_rate) < 0) {
+      std::cerr << "Warning: Failed to set sample rate.\n";
+      return false;
+    }
+    return true;
+  }
+
+  uint32_t tuner_type() { return rtlsdr_get_tuner_type(dev); }
+
+  // Number of discrete gain steps the tuner supports
+  uint32_t gain_count() {
+    int count = rtlsdr_get_tuner_gains(dev, nullptr);
+    return count > 0 ? static_cast<uint32_t>(count) : 0;
+  }
+
+  std::size_t read(uint8_t *dest, std::size_t max_size) override {
+    int bytes_read = 0;
+    int result = rtlsdr_read_sync(dev, dest, static_cast<int>(max_size),
+                                  &bytes_read);
+
+    if (result < 0) {
+      throw std::runtime_error("Error reading from device.\n");
+    }
+
+    // Short reads are flagged on the block and counted by the producer
+    return static_cast<std::size_t>(bytes_read);
+  }
+
+  void stream(const BlockCallback &callback) override {
+    if (!async_mode) {
+      IQSource::stream(callback);
+      return;
+    }
+    read_async(callback);
+  }
+
+  void stop() override {
+    IQSource::stop();
+    if (async_mode) {
+      rtlsdr_cancel_async(dev);
+    }
+  }
+
+  // Streams samples using librtlsdr's callback API with num_buffers USB
+  // transfers in flight, so the dongle keeps filling buffers while the
+  // callback is busy. The callback gets pointers straight into the libusb
+  // transfer buffers. Blocks until stop() is called.
+  void read_async(const BlockCallback &callback,
+                  uint32_t num_buffers = ASYNC_BUF_NUM) {
+    async_callback = &callback;
+    int result = rtlsdr_read_async(dev, &SdrDevice::async_trampoline, this,
+                                   num_buffers, BUF_SIZE);
+    async_callback = nullptr;
+
+    if (result < 0) {
+      throw std::runtime_error("Error reading from device (async).\n");
+    }
+  }
+
+public:
+  static constexpr int BUF_SIZE = static_cast<int>(BLOCK_SIZE);
+  // DEFAULT_ASYNC_BUF_NUMBER in librtlsdr.c source code
+  static constexpr uint32_t ASYNC_BUF_NUM = 15;
+
+private:
+  static void async_trampoline(unsigned char *buf, uint32_t len, void *ctx) {
+    auto *self = static_cast<SdrDevice *>(ctx);
+    (*self->async_callback)(self->make_block(buf, len, BUF_SIZE));
+  }
+
+  int index;
+  bool async_mode;
+  rtlsdr_dev_t *dev = nullptr;
+  const BlockCallback *async_callback = nullptr;
+};
@@ -0,0 +1,474 @@
+#pragma once
+
+#include "BlockPool.hpp"
+#include "IQSource.hpp"
+#include "SPSCQueue.hpp"
+#include "StreamBuffer.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <exception>
+#include <fcntl.h>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Records the raw IQ stream to a SigMF recording (<base>.sigmf-data plus
+// <base>.sigmf-meta) on its own thread. The producer only ever does a
+// non-blocking push of a pool block, if the disk falls behind the block is
+// dropped and counted instead of stalling the audio path. Every block
+// carries its center frequency, a change becomes a new capture segment.
+//
+// With a pre-trigger window the recorder works as a "time machine": it
+// holds on to the blocks of the last pre_trigger_seconds of IQ instead of
+// writing them out. When trigger() is called the buffered past plus the
+// following post_trigger_seconds are written to <base>-0001, <base>-0002,
+// ... The window is made of the pool blocks the producer already filled,
+// so it costs no extra memcpy.
+class SigMFRecorder {
+public:
+  SigMFRecorder(const std::string &base_path, int sample_rate, int frequency,
+                int gain_db, float pre_trigger_seconds = 0.0f,
+                float post_trigger_seconds = 0.0f)
+      : queue(power_of_two(needed_blocks(sample_rate, pre_trigger_seconds))),
+        held_blocks(needed_blocks(sample_rate, pre_trigger_seconds)),
+        base_path(base_path), sample_rate(sample_rate), frequency(frequency),
+        gain_db(gain_db), triggered_mode(pre_trigger_seconds > 0.0f),
+        pre_trigger_samples(seconds_to_samples(pre_trigger_seconds)),
+        post_trigger_samples(seconds_to_samples(post_trigger_seconds)) {}
+
+  ~SigMFRecorder() { stop(); }
+
+  SigMFRecorder(const SigMFRecorder &) = delete;
+  SigMFRecorder &operator=(const SigMFRecorder &) = delete;
+
+  void start() {
+    // Page aligned, as O_DIRECT wants it
+    write_memory = StreamBuffer(WRITE_SIZE);
+    write_buffer = write_memory.data();
+
+    if (!triggered_mode) {
+      open_recording(base_path, std::chrono::system_clock::now());
+    } else {
+      std::cout << "Recorder armed, keeping the last "
+                << static_cast<double>(pre_trigger_samples) / sample_rate
+                << " s\n";
+    }
+
+    recording = true;
+    writer = std::thread(&SigMFRecorder::writer_thread, this);
+  }
+
+  void stop() {
+    if (!recording) {
+      return;
+    }
+    recording = false;
+    writer.join();
+
+    write_buffer = nullptr;
+    write_memory = StreamBuffer();
+  }
+
+  // Called from the producer thread, never blocks. Takes over one reference
+  // to the block.
+  void push(const BlockRef &block) {
+    // The queue has room for more than the pool budgets for us, past that
+    // we'd eat into the server's blocks
+    if (queue.size() >= held_blocks || !queue.push(block)) {
+      BlockPool::release(block);
+      count_dropped(block.len);
+      return;
+    }
+    pushed_samples.store(pushed_samples.load(std::memory_order_relaxed) +
+                             block.samples(),
+                         std::memory_order_release);
+  }
+
+  // Producer thread: len bytes that never made it into a block
+  void count_dropped(std::size_t len) {
+    dropped_bytes.fetch_add(len, std::memory_order_relaxed);
+  }
+
+  // Most blocks the recorder holds at once, for sizing the pool. Not the
+  // queue's capacity, that is rounded up to a power of 2 and would pin
+  // up to twice the memory for a long pre-trigger window.
+  std::size_t max_blocks() const { return held_blocks + 1; }
+
+  // Starts (or extends) a triggered recording. Only touches an atomic, so it
+  // is safe to call from any thread and from signal handlers.
+  void trigger() { trigger_requested.store(true, std::memory_order_relaxed); }
+
+  bool is_triggered_mode() const { return triggered_mode; }
+
+  // True while a recording file is open
+  bool active() const { return file_open.load(std::memory_order_relaxed); }
+
+  std::size_t dropped() const {
+    return dropped_bytes.load(std::memory_order_relaxed);
+  }
+
+  // Counts blocks, for the stats thread
+  QueueTelemetry queue_telemetry() { return queue.telemetry(); }
+
+private:
+  void writer_thread() {
+    std::size_t fill = 0;
+
+    while (true) {
+      // Read the flag before popping so nothing pushed before stop() is lost
+      bool stopping = !recording;
+
+      if (triggered_mode && trigger_requested.exchange(false)) {
+        if (!file_open) {
+          // Everything still buffered is the pre-trigger window
+          auto buffered = std::chrono::duration<double>(
+              static_cast<double>(buffered_samples()) / sample_rate);
+          try {
+            open_recording(
+                base_path + "-" + sequence_suffix(++trigger_count),
+                std::chrono::system_clock::now() -
+                    std::chrono::duration_cast<
+                        std::chrono::system_clock::duration>(buffered));
+          } catch (const std::exception &e) {
+            // Nothing to write to, stay armed for the next trigger
+            std::cerr << "Error: " << e.what() << ", trigger ignored\n";
+          }
+        }
+        // A trigger while recording extends the recording from now on
+        remaining_samples = buffered_samples() + post_trigger_samples;
+      }
+
+      if (triggered_mode && !file_open) {
+        if (stopping)
+          break;
+        trim_to_window();
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        continue;
+      }
+
+      if (!take_block()) {
+        if (stopping)
+          break;
+        // Sleeps until the producer pushes, the timeout lets us notice
+        // stop() and triggers
+        queue.wait_for_data(1, IDLE_WAIT);
+        continue;
+      }
+
+      if (current.frequency != captures.back().second) {
+        std::size_t sample_start = (bytes_written + fill) / 2;
+        if (sample_start == captures.back().first) {
+          // Nothing recorded at the old frequency yet
+          captures.back().second = current.frequency;
+        } else {
+          captures.emplace_back(sample_start, current.frequency);
+        }
+      }
+
+      // Both lengths are whole samples, so fill always is too
+      std::size_t len = std::min(current.len - current_offset,
+                                 WRITE_SIZE - fill);
+      if (triggered_mode) {
+        len = std::min(len, remaining_samples * 2);
+      }
+      std::memcpy(write_buffer + fill, current.data + current_offset, len);
+      fill += len;
+      advance(len);
+
+      if (fill == WRITE_SIZE) {
+        write_all(write_buffer, fill);
+        fill = 0;
+      }
+
+      if (triggered_mode) {
+        remaining_samples -= len / 2;
+        if (remaining_samples == 0) {
+          close_recording(fill);
+          fill = 0;
+        }
+      }
+    }
+
+    if (file_open) {
+      close_recording(fill);
+    }
+
+    // Hand back everything we still hold
+    while (take_block()) {
+      advance(current.len - current_offset);
+    }
+  }
+
+  // Makes sure current is a block with bytes left. Returns false if there
+  // is none.
+  bool take_block() {
+    if (has_current) {
+      return true;
+    }
+    if (queue.pop(&current, 1) == 0) {
+      return false;
+    }
+    has_current = true;
+    current_offset = 0;
+    return true;
+  }
+
+  // Marks len bytes of current as done, releasing it when it is used up
+  void advance(std::size_t len) {
+    current_offset += len;
+    taken_samples += len / 2;
+    if (current_offset == current.len) {
+      // The frequency of the newest sample that went by
+      frequency = current.frequency;
+      BlockPool::release(current);
+      has_current = false;
+    }
+  }
+
+  // Samples pushed that are not written or dropped yet
+  std::size_t buffered_samples() const {
+    return pushed_samples.load(std::memory_order_acquire) - taken_samples;
+  }
+
+  // Lets go of the oldest blocks as long as the rest still covers the
+  // pre-trigger window
+  void trim_to_window() {
+    while (take_block()) {
+      std::size_t left = (current.len - current_offset) / 2;
+      if (buffered_samples() - left < pre_trigger_samples) {
+        return;
+      }
+      advance(current.len - current_offset);
+    }
+  }
+
+  void open_recording(const std::string &path,
+                      std::chrono::system_clock::time_point start) {
+    current_path = path;
+    std::string data_path = path + ".sigmf-data";
+
+    // O_DIRECT skips the page cache, which keeps the writeback of a long
+    // recording from evicting everything else. Not every filesystem supports
+    // it (tmpfs, some FUSE mounts), fall back to buffered writes.
+    fd = ::open(data_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT,
+                0644);
+    direct_io = fd >= 0;
+    if (fd < 0) {
+      fd = ::open(data_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    }
+    if (fd < 0) {
+      throw std::runtime_error("Failed to open " + data_path + ": " +
+                               std::strerror(errno));
+    }
+
+    bytes_written = 0;
+    dropped_at_start = dropped();
+    // Corrected by the first block if that was tuned elsewhere
+    captures.assign(1, {0, has_current ? current.frequency : frequency});
+
+    start_time = iso8601(start);
+    stop_time.clear();
+    write_meta();
+    file_open = true;
+
+    std::cout << "Recording to " << data_path
+              << (direct_io ? " (O_DIRECT)" : "") << "\n";
+  }
+
+  void close_recording(std::size_t fill) {
+    // O_DIRECT needs aligned lengths, write the tail through the page cache
+    if (fill > 0) {
+      if (direct_io) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      }
+      write_all(write_buffer, fill);
+    }
+
+    ::close(fd);
+    fd = -1;
+    file_open = false;
+
+    stop_time = iso8601(std::chrono::system_clock::now());
+    write_meta();
+
+    std::cout << "Recording stopped, " << bytes_written / 2
+              << " samples written, " << (dropped() - dropped_at_start) / 2
+              << " samples dropped\n";
+  }
+
+  void write_all(const uint8_t *data, std::size_t len) {
+    while (len > 0) {
+      ssize_t r = ::write(fd, data, len);
+      if (r < 0) {
+        if (errno == EINTR)
+          continue;
+        if (errno == EINVAL && direct_io) {
+          // Filesystem accepted O_DIRECT on open but not on write
+          fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+          direct_io = false;
+          continue;
+        }
+        std::cerr << "Warning: Recording write failed: "
+                  << std::strerror(errno) << "\n";
+        return;
+      }
+      data += r;
+      len -= static_cast<std::size_t>(r);
+      bytes_written += static_cast<std::size_t>(r);
+    }
+  }
+
+  void write_meta() {
+    std::ofstream meta(current_path + ".sigmf-meta");
+    meta << "{\n"
+         << "  \"global\": {\n"
+         << "    \"core:datatype\": \"cu8\",\n"
+         << "    \"core:sample_rate\": " << sample_rate << ",\n"
+         << "    \"core:version\": \"1.0.0\",\n"
+         << "    \"core:recorder\": \"aether-sdr\",\n"
+         << "    \"core:hw\": \"RTL-SDR\",\n"
+         << "    \"core:extensions\": [{\"name\": \"aether\", \"version\": "
+            "\"1.0.0\", \"optional\": true}],\n"
+         << "    \"aether:gain_db\": " << gain_db << ",\n";
+    if (!stop_time.empty()) {
+      meta << "    \"aether:stop_datetime\": \"" << stop_time << "\",\n";
+    }
+    meta << "    \"aether:dropped_samples\": "
+         << (dropped() - dropped_at_start) / 2 << "\n"
+         << "  },\n"
+         << "  \"captures\": [\n"
+         << "    {\n"
+         << "      \"core:sample_start\": 0,\n"
+         << "      \"core:frequency\": " << captures.front().second << ",\n"
+         << "      \"core:datetime\": \"" << start_time << "\"\n"
+         << "    }";
+
+    // One more capture per retune that made it into the file
+    for (std::size_t i = 1; i < captures.size(); i++) {
+      meta << ",\n"
+           << "    {\n"
+           << "      \"core:sample_start\": " << captures[i].first << ",\n"
+           << "      \"core:frequency\": " << captures[i].second << "\n"
+           << "    }";
+    }
+
+    meta << "\n"
+         << "  ],\n"
+         << "  \"annotations\": []\n"
+         << "}\n";
+
+    // Without it the data file can't be read back, say so
+    meta.close();
+    if (meta.fail()) {
+      std::cerr << "Warning: Failed to write " << current_path
+                << ".sigmf-meta: " << std::strerror(errno) << "\n";
+    }
+  }
+
+  static std::string iso8601(std::chrono::system_clock::time_point when) {
+    std::time_t t = std::chrono::system_clock::to_time_t(when);
+    auto ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                  when.time_since_epoch())
+                  .count() %
+              1000;
+
+    std::tm tm;
+    gmtime_r(&t, &tm);
+    char buf[32];
+    std::strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+    char out[40];
+    std::snprintf(out, sizeof(out), "%s.%03dZ", buf, static_cast<int>(ms));
+    return out;
+  }
+
+  static std::string sequence_suffix(int n) {
+    char buf[16];
+    std::snprintf(buf, sizeof(buf), "%04d", n);
+    return buf;
+  }
+
+  std::size_t seconds_to_samples(float seconds) const {
+    return static_cast<std::size_t>(seconds * sample_rate);
+  }
+
+  // Blocks for the pre-trigger window plus the usual slack. The producer
+  // packs the pool blocks full, so the window is counted in full ones.
+  static std::size_t needed_blocks(int sample_rate,
+                                   float pre_trigger_seconds) {
+    std::size_t window_bytes =
+        static_cast<std::size_t>(pre_trigger_seconds * sample_rate) * 2;
+    return (window_bytes + IQSource::BLOCK_SIZE - 1) / IQSource::BLOCK_SIZE +
+           QUEUE_BLOCKS;
+  }
+
+  // The queue only holds descriptors, rounding it up costs next to nothing
+  static std::size_t power_of_two(std::size_t n) {
+    std::size_t size = 1;
+    while (size < n) {
+      size <<= 1;
+    }
+    return size;
+  }
+
+  // ~3.5 s at 2.4 Msps of slack for slow disks
+  static constexpr std::size_t QUEUE_BLOCKS = 64;
+  // Large writes keep SD cards and their FTLs happy
+  static constexpr std::size_t WRITE_SIZE = 1 << 22;
+  static constexpr std::chrono::milliseconds IDLE_WAIT{10};
+
+  SPSCQueue<BlockRef> queue;
+  // Most blocks queued at once, what the pool is sized for
+  std::size_t held_blocks;
+  std::string base_path;
+  int sample_rate;
+  // Of the last block the writer got through, until the first one the
+  // frequency the recorder was created with
+  int frequency;
+  int gain_db;
+
+  // Pre-trigger ("time machine") state
+  bool triggered_mode;
+  std::size_t pre_trigger_samples;
+  std::size_t post_trigger_samples;
+  std::atomic<bool> trigger_requested{false};
+  int trigger_count = 0;
+  std::size_t remaining_samples = 0;
+
+  // Writer only: the block being written out and how far
+  BlockRef current{};
+  bool has_current = false;
+  std::size_t current_offset = 0;
+  std::atomic<std::size_t> pushed_samples{0};
+  std::size_t taken_samples = 0;
+  // Sample in the open file where each capture starts, and its frequency
+  std::vector<std::pair<std::size_t, int>> captures;
+
+  std::string current_path;
+  int fd = -1;
+  bool direct_io = false;
+  std::atomic<bool> file_open{false};
+  StreamBuffer write_memory;
+  uint8_t *write_buffer = nullptr;
+  std::size_t bytes_written = 0;
+  std::atomic<std::size_t> dropped_bytes{0};
+  std::size_t dropped_at_start = 0;
+
+  std::string start_time;
+  std::string stop_time;
+
+  std::atomic<bool> recording{false};
+  std::thread writer;
+};
@@ -0,0 +1,315 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+// Just enough of a float vector for the DSP kernels, picked at compile time
+// from what the target has: AVX2 (8 lanes), SSE2 (4 lanes, any x86-64),
+// NEON (4 lanes) or plain floats. Build with ARCH_FLAGS=-march=native to get
+// AVX2 (and FMA) on a machine that has it.
+//
+// Loads and stores are unaligned. Masks come from the comparisons and are
+// only good for select().
+namespace simd {
+
+#if defined(__AVX2__)
+
+static constexpr const char *NAME = "AVX2";
+static constexpr std::size_t WIDTH = 8;
+
+struct Floats {
+  __m256 v;
+};
+struct Mask {
+  __m256 v;
+};
+
+inline Floats load(const float *p) { return {_mm256_loadu_ps(p)}; }
+inline void store(float *p, Floats a) { _mm256_storeu_ps(p, a.v); }
+inline Floats broadcast(float x) { return {_mm256_set1_ps(x)}; }
+
+inline Floats operator+(Floats a, Floats b) {
+  return {_mm256_add_ps(a.v, b.v)};
+}
+inline Floats operator-(Floats a, Floats b) {
+  return {_mm256_sub_ps(a.v, b.v)};
+}
+inline Floats operator*(Floats a, Floats b) {
+  return {_mm256_mul_ps(a.v, b.v)};
+}
+inline Floats operator/(Floats a, Floats b) {
+  return {_mm256_div_ps(a.v, b.v)};
+}
+
+// a * b + c
+inline Floats mul_add(Floats a, Floats b, Floats c) {
+#if defined(__FMA__)
+  return {_mm256_fmadd_ps(a.v, b.v, c.v)};
+#else
+  return {_mm256_add_ps(_mm256_mul_ps(a.v, b.v), c.v)};
+#endif
+}
+
+inline Floats min(Floats a, Floats b) { return {_mm256_min_ps(a.v, b.v)}; }
+inline Floats max(Floats a, Floats b) { return {_mm256_max_ps(a.v, b.v)}; }
+
+inline Mask operator<(Floats a, Floats b) {
+  return {_mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ)};
+}
+
+// Lanes of a where mask is set, of b elsewhere
+inline Floats select(Mask mask, Floats a, Floats b) {
+  return {_mm256_blendv_ps(b.v, a.v, mask.v)};
+}
+
+inline Floats sign_bits(Floats a) {
+  return {_mm256_and_ps(a.v, _mm256_set1_ps(-0.0f))};
+}
+inline Floats operator^(Floats a, Floats b) {
+  return {_mm256_xor_ps(a.v, b.v)};
+}
+
+// 2 * WIDTH interleaved floats (I/Q pairs) split into the even and odd ones
+inline void deinterleave(const float *p, Floats &even, Floats &odd) {
+  __m256 lo = _mm256_loadu_ps(p);
+  __m256 hi = _mm256_loadu_ps(p + 8);
+  // Shuffles stay within 128 bit lanes, so the halves come out as
+  // 0 1 4 5 | 2 3 6 7 and have to be swapped back into order
+  __m256 e = _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+  __m256 o = _mm256_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1));
+  even.v = _mm256_castpd_ps(
+      _mm256_permute4x64_pd(_mm256_castps_pd(e), _MM_SHUFFLE(3, 1, 2, 0)));
+  odd.v = _mm256_castpd_ps(
+      _mm256_permute4x64_pd(_mm256_castps_pd(o), _MM_SHUFFLE(3, 1, 2, 0)));
+}
+
+// WIDTH bytes widened to floats
+inline Floats load_u8(const uint8_t *p) {
+  __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+  return {_mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(bytes))};
+}
+
+inline float sum(Floats a) {
+  __m128 s = _mm_add_ps(_mm256_castps256_ps128(a.v),
+                        _mm256_extractf128_ps(a.v, 1));
+  s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+inline float first(Floats a) { return _mm256_cvtss_f32(a.v); }
+
+#elif defined(__SSE2__)
+
+static constexpr const char *NAME = "SSE2";
+static constexpr std::size_t WIDTH = 4;
+
+struct Floats {
+  __m128 v;
+};
+struct Mask {
+  __m128 v;
+};
+
+inline Floats load(const float *p) { return {_mm_loadu_ps(p)}; }
+inline void store(float *p, Floats a) { _mm_storeu_ps(p, a.v); }
+inline Floats broadcast(float x) { return {_mm_set1_ps(x)}; }
+
+inline Floats operator+(Floats a, Floats b) { return {_mm_add_ps(a.v, b.v)}; }
+inline Floats operator-(Floats a, Floats b) { return {_mm_sub_ps(a.v, b.v)}; }
+inline Floats operator*(Floats a, Floats b) { return {_mm_mul_ps(a.v, b.v)}; }
+inline Floats operator/(Floats a, Floats b) { return {_mm_div_ps(a.v, b.v)}; }
+
+inline Floats mul_add(Floats a, Floats b, Floats c) {
+  return {_mm_add_ps(_mm_mul_ps(a.v, b.v), c.v)};
+}
+
+inline Floats min(Floats a, Floats b) { return {_mm_min_ps(a.v, b.v)}; }
+inline Floats max(Floats a, Floats b) { return {_mm_max_ps(a.v, b.v)}; }
+
+inline Mask operator<(Floats a, Floats b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+
+// No blendv before SSE4.1
+inline Floats select(Mask mask, Floats a, Floats b) {
+  return {_mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v))};
+}
+
+inline Floats sign_bits(Floats a) {
+  return {_mm_and_ps(a.v, _mm_set1_ps(-0.0f))};
+}
+inline Floats operator^(Floats a, Floats b) { return {_mm_xor_ps(a.v, b.v)}; }
+
+inline void deinterleave(const float *p, Floats &even, Floats &odd) {
+  __m128 lo = _mm_loadu_ps(p);
+  __m128 hi = _mm_loadu_ps(p + 4);
+  even.v = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(2, 0, 2, 0));
+  odd.v = _mm_shuffle_ps(lo, hi, _MM_SHUFFLE(3, 1, 3, 1));
+}
+
+inline Floats load_u8(const uint8_t *p) {
+  int32_t word;
+  std::memcpy(&word, p, sizeof(word));
+  __m128i zero = _mm_setzero_si128();
+  __m128i bytes = _mm_cvtsi32_si128(word);
+  __m128i words = _mm_unpacklo_epi8(bytes, zero);
+  return {_mm_cvtepi32_ps(_mm_unpacklo_epi16(words, zero))};
+}
+
+inline float sum(Floats a) {
+  __m128 s = _mm_add_ps(a.v, _mm_movehl_ps(a.v, a.v));
+  s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+  return _mm_cvtss_f32(s);
+}
+
+inline float first(Floats a) { return _mm_cvtss_f32(a.v); }
+
+#elif defined(__ARM_NEON)
+
+static constexpr const char *NAME = "NEON";
+static constexpr std::size_t WIDTH = 4;
+
+struct Floats {
+  float32x4_t v;
+};
+struct Mask {
+  uint32x4_t v;
+};
+
+inline Floats load(const float *p) { return {vld1q_f32(p)}; }
+inline void store(float *p, Floats a) { vst1q_f32(p, a.v); }
+inline Floats broadcast(float x) { return {vdupq_n_f32(x)}; }
+
+inline Floats operator+(Floats a, Floats b) { return {vaddq_f32(a.v, b.v)}; }
+inline Floats operator-(Floats a, Floats b) { return {vsubq_f32(a.v, b.v)}; }
+inline Floats operator*(Floats a, Floats b) { return {vmulq_f32(a.v, b.v)}; }
+
+inline Floats operator/(Floats a, Floats b) {
+#if defined(__aarch64__)
+  return {vdivq_f32(a.v, b.v)};
+#else
+  // 32 bit ARM has no vector divide, two Newton steps on the estimate get
+  // the reciprocal to within a few ulp
+  float32x4_t r = vrecpeq_f32(b.v);
+  r = vmulq_f32(r, vrecpsq_f32(b.v, r));
+  r = vmulq_f32(r, vrecpsq_f32(b.v, r));
+  return {vmulq_f32(a.v, r)};
+#endif
+}
+
+inline Floats mul_add(Floats a, Floats b, Floats c) {
+  return {vmlaq_f32(c.v, a.v, b.v)};
+}
+
+inline Floats min(Floats a, Floats b) { return {vminq_f32(a.v, b.v)}; }
+inline Floats max(Floats a, Floats b) { return {vmaxq_f32(a.v, b.v)}; }
+
+inline Mask operator<(Floats a, Floats b) { return {vcltq_f32(a.v, b.v)}; }
+
+inline Floats select(Mask mask, Floats a, Floats b) {
+  return {vbslq_f32(mask.v, a.v, b.v)};
+}
+
+inline Floats sign_bits(Floats a) {
+  return {vreinterpretq_f32_u32(
+      vandq_u32(vreinterpretq_u32_f32(a.v), vdupq_n_u32(0x80000000u)))};
+}
+inline Floats operator^(Floats a, Floats b) {
+  return {vreinterpretq_f32_u32(
+      veorq_u32(vreinterpretq_u32_f32(a.v), vreinterpretq_u32_f32(b.v)))};
+}
+
+inline void deinterleave(const float *p, Floats &even, Floats &odd) {
+  float32x4x2_t pairs = vld2q_f32(p);
+  even.v = pairs.val[0];
+  odd.v = pairs.val[1];
+}
+
+inline Floats load_u8(const uint8_t *p) {
+  uint32_t word;
+  std::memcpy(&word, p, sizeof(word));
+  uint16x8_t words = vmovl_u8(vreinterpret_u8_u32(vdup_n_u32(word)));
+  return {vcvtq_f32_u32(vmovl_u16(vget_low_u16(words)))};
+}
+
+inline float sum(Floats a) {
+  float32x2_t s = vadd_f32(vget_low_f32(a.v), vget_high_f32(a.v));
+  return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+
+inline float first(Floats a) { return vgetq_lane_f32(a.v, 0); }
+
+#else
+
+static constexpr const char *NAME = "scalar";
+static constexpr std::size_t WIDTH = 1;
+
+struct Floats {
+  float v;
+};
+struct Mask {
+  bool v;
+};
+
+inline Floats load(const float *p) { return {*p}; }
+inline void store(float *p, Floats a) { *p = a.v; }
+inline Floats broadcast(float x) { return {x}; }
+
+inline Floats operator+(Floats a, Floats b) { return {a.v + b.v}; }
+inline Floats operator-(Floats a, Floats b) { return {a.v - b.v}; }
+inline Floats operator*(Floats a, Floats b) { return {a.v * b.v}; }
+inline Floats operator/(Floats a, Floats b) { return {a.v / b.v}; }
+
+inline Floats mul_add(Floats a, Floats b, Floats c) {
+  return {a.v * b.v + c.v};
+}
+
+inline Floats min(Floats a, Floats b) { return {a.v < b.v ? a.v : b.v}; }
+inline Floats max(Floats a, Floats b) { return {a.v > b.v ? a.v : b.v}; }
+
+inline Mask operator<(Floats a, Floats b) { return {a.v < b.v}; }
+
+inline Floats select(Mask mask, Floats a, Floats b) {
+  return {mask.v ? a.v : b.v};
+}
+
+inline Floats sign_bits(Floats a) {
+  uint32_t bits;
+  std::memcpy(&bits, &a.v, sizeof(bits));
+  bits &= 0x80000000u;
+  std::memcpy(&a.v, &bits, sizeof(bits));
+  return a;
+}
+inline Floats operator^(Floats a, Floats b) {
+  uint32_t x, y;
+  std::memcpy(&x, &a.v, sizeof(x));
+  std::memcpy(&y, &b.v, sizeof(y));
+  x ^= y;
+  std::memcpy(&a.v, &x, sizeof(x));
+  return a;
+}
+
+inline void deinterleave(const float *p, Floats &even, Floats &odd) {
+  even.v = p[0];
+  odd.v = p[1];
+}
+
+inline Floats load_u8(const uint8_t *p) { return {static_cast<float>(*p)}; }
+
+inline float sum(Floats a) { return a.v; }
+
+inline float first(Floats a) { return a.v; }
+
+#endif
+
+inline Floats abs(Floats a) { return a ^ sign_bits(a); }
+
+} // namespace simd
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <type_traits>
+#include <unistd.h>
+#include <utility>
+
+// Memory for the long-lived streaming buffers: rings, the block pool, the
+// recorder's write buffer, the FFT buffers and the scratch buffers of the DSP
+// chain (see StreamArray). By default it is plain
+// anonymous memory. configure() can ask for 2 MiB huge pages (fewer TLB
+// misses when walking a ring) and for memory that is locked and pre-faulted,
+// so a thread that touches it under memory pressure never takes a page
+// fault. Whatever the system refuses falls back to normal pages with a
+// warning, and report() tells what was actually obtained.
+class StreamBuffer {
+public:
+  struct Options {
+    bool huge_pages = false;
+    bool lock = false;
+  };
+
+  // Bytes held right now
+  struct Report {
+    // Reserved huge pages (hugetlbfs)
+    uint64_t huge_bytes = 0;
+    // Normal pages advised to become transparent huge pages, which the
+    // kernel may or may not do
+    uint64_t transparent_bytes = 0;
+    uint64_t normal_bytes = 0;
+    uint64_t locked_bytes = 0;
+    uint64_t lock_failures = 0;
+  };
+
+  static constexpr std::size_t HUGE_PAGE_SIZE = 2 << 20;
+
+  // Before the first buffer is allocated
+  static void configure(const Options &o) { settings() = o; }
+  static const Options &options() { return settings(); }
+
+  // Sizes that are a multiple of this can be backed by huge pages
+  static std::size_t granule() {
+    return options().huge_pages ? HUGE_PAGE_SIZE : page_size();
+  }
+
+  static std::size_t page_size() {
+    return static_cast<std::size_t>(sysconf(_SC_PAGESIZE));
+  }
+
+  static Report report() {
+    Report r;
+    r.huge_bytes = huge_bytes.load(std::memory_order_relaxed);
+    r.transparent_bytes = transparent_bytes.load(std::memory_order_relaxed);
+    r.normal_bytes = normal_bytes.load(std::memory_order_relaxed);
+    r.locked_bytes = locked_bytes.load(std::memory_order_relaxed);
+    r.lock_failures = lock_failures.load(std::memory_order_relaxed);
+    return r;
+  }
+
+  // Extra mmap flags for a mapping of stream memory: pre-faulting is only
+  // worth it (and only asked for) together with huge pages or locking
+  static int map_flags() {
+    return options().huge_pages || options().lock ? MAP_POPULATE : 0;
+  }
+
+  // Which counters a mapping was added to, for release()
+  enum Counted : unsigned {
+    ON_HUGE_PAGES = 1 << 0,
+    ON_TRANSPARENT_PAGES = 1 << 1,
+    ON_NORMAL_PAGES = 1 << 2,
+    LOCKED = 1 << 3,
+  };
+
+  // Applies the options to a mapping made elsewhere (MirroredBuffer) and
+  // counts it. huge says whether it is already on reserved huge pages.
+  // Returns what release() takes back once the mapping goes away.
+  static unsigned prepare(void *addr, std::size_t size, bool huge) {
+    unsigned counted;
+    if (huge) {
+      counted = ON_HUGE_PAGES;
+    } else if (options().huge_pages &&
+               madvise(addr, size, MADV_HUGEPAGE) == 0) {
+      counted = ON_TRANSPARENT_PAGES;
+    } else {
+      counted = ON_NORMAL_PAGES;
+    }
+
+    if (options().lock) {
+      if (mlock(addr, size) == 0) {
+        counted |= LOCKED;
+      } else if (lock_failures.fetch_add(1, std::memory_order_relaxed) == 0) {
+        // Usually RLIMIT_MEMLOCK, once is enough
+        std::cerr << "Warning: Failed to lock stream memory ("
+                  << std::strerror(errno) << "), see ulimit -l\n";
+      }
+    }
+    count(counted, size, true);
+    return counted;
+  }
+
+  static void release(unsigned counted, std::size_t size) {
+    count(counted, size, false);
+  }
+
+  StreamBuffer() = default;
+
+  // size bytes of zeroed, page aligned memory
+  explicit StreamBuffer(std::size_t size) {
+    if (size == 0) {
+      throw std::invalid_argument("StreamBuffer size has to be positive");
+    }
+
+    // Rounding a small buffer up to a whole huge page would waste most of it
+    if (options().huge_pages && size >= HUGE_PAGE_SIZE) {
+      std::size_t rounded = round_up(size, HUGE_PAGE_SIZE);
+      void *addr = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                            (21 << MAP_HUGE_SHIFT) | map_flags(),
+                        -1, 0);
+      if (addr != MAP_FAILED) {
+        base = static_cast<uint8_t *>(addr);
+        map_size = rounded;
+        counted = prepare(base, map_size, true);
+        return;
+      }
+      warn_no_huge_pages();
+    }
+
+    std::size_t rounded = round_up(size, page_size());
+    void *addr = mmap(nullptr, rounded, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (addr == MAP_FAILED) {
+      throw std::runtime_error(std::string("Failed to map stream memory: ") +
+                               std::strerror(errno));
+    }
+    base = static_cast<uint8_t *>(addr);
+    map_size = rounded;
+    // Advised before the pages are touched, so they can come in huge
+    counted = prepare(base, map_size, false);
+    // Unless mlock() already faulted everything in
+    if (map_flags() && !options().lock) {
+      prefault(base, map_size);
+    }
+  }
+
+  ~StreamBuffer() {
+    if (base) {
+      munmap(base, map_size);
+      release(counted, map_size);
+    }
+  }
+
+  StreamBuffer(const StreamBuffer &) = delete;
+  StreamBuffer &operator=(const StreamBuffer &) = delete;
+
+  StreamBuffer(StreamBuffer &&other) noexcept
+      : base(std::exchange(other.base, nullptr)),
+        map_size(std::exchange(other.map_size, 0)),
+        counted(std::exchange(other.counted, 0)) {}
+
+  StreamBuffer &operator=(StreamBuffer &&other) noexcept {
+    std::swap(base, other.base);
+    std::swap(map_size, other.map_size);
+    std::swap(counted, other.counted);
+    return *this;
+  }
+
+  uint8_t *data() const { return base; }
+  // Can be more than was asked for
+  std::size_t size() const { return map_size; }
+
+  static void warn_no_huge_pages() {
+    static std::atomic<bool> warned{false};
+    if (!warned.exchange(true, std::memory_order_relaxed)) {
+      std::cerr << "Warning: No huge pages available (see "
+                   "/proc/sys/vm/nr_hugepages), using normal pages\n";
+    }
+  }
+
+private:
+  static Options &settings() {
+    static Options o;
+    return o;
+  }
+
+  static void count(unsigned counted, std::size_t size, bool add) {
+    for (auto [bit, bytes] : {std::pair{ON_HUGE_PAGES, &huge_bytes},
+                              {ON_TRANSPARENT_PAGES, &transparent_bytes},
+                              {ON_NORMAL_PAGES, &normal_bytes},
+                              {LOCKED, &locked_bytes}}) {
+      if (!(counted & bit)) {
+        continue;
+      }
+      if (add) {
+        bytes->fetch_add(size, std::memory_order_relaxed);
+      } else {
+        bytes->fetch_sub(size, std::memory_order_relaxed);
+      }
+    }
+  }
+
+  static std::size_t round_up(std::size_t size, std::size_t to) {
+    return (size + to - 1) / to * to;
+  }
+
+  // Writes one byte per page so the kernel backs all of them now
+  static void prefault(uint8_t *addr, std::size_t size) {
+    for (std::size_t i = 0; i < size; i += page_size()) {
+      reinterpret_cast<volatile uint8_t *>(addr)[i] = 0;
+    }
+  }
+
+  static inline std::atomic<uint64_t> huge_bytes{0};
+  static inline std::atomic<uint64_t> transparent_bytes{0};
+  static inline std::atomic<uint64_t> normal_bytes{0};
+  static inline std::atomic<uint64_t> locked_bytes{0};
+  static inline std::atomic<uint64_t> lock_failures{0};
+
+  uint8_t *base = nullptr;
+  std::size_t map_size = 0;
+  // What prepare() counted
+  unsigned counted = 0;
+};
+
+// size elements of T in a StreamBuffer, zeroed. For the DSP chain's scratch
+// buffers that would otherwise be std::vectors, it has the same data(),
+// size() and iterators.
+template <typename T> class StreamArray {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "StreamArray doesn't construct its elements");
+
+public:
+  StreamArray() = default;
+
+  explicit StreamArray(std::size_t size)
+      : memory(size * sizeof(T)), count(size) {}
+
+  StreamArray(StreamArray &&other) noexcept
+      : memory(std::move(other.memory)),
+        count(std::exchange(other.count, 0)) {}
+
+  StreamArray &operator=(StreamArray &&other) noexcept {
+    std::swap(memory, other.memory);
+    std::swap(count, other.count);
+    return *this;
+  }
+
+  T *data() { return reinterpret_cast<T *>(memory.data()); }
+  const T *data() const { return reinterpret_cast<const T *>(memory.data()); }
+  std::size_t size() const { return count; }
+
+  T &operator[](std::size_t i) { return data()[i]; }
+  const T &operator[](std::size_t i) const { return data()[i]; }
+
+  T *begin() { return data(); }
+  T *end() { return data() + count; }
+  const T *begin() const { return data(); }
+  const T *end() const { return data() + count; }
+
+private:
+  StreamBuffer memory;
+  std::size_t count = 0;
+};
@@ -0,0 +1,218 @@
+#pragma once
+
+#include "IQSource.hpp"
+#include "RtlTcp.hpp"
+#include "StreamBuffer.hpp"
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdexcept>
+#include <string>
+#include <sys/socket.h>
+#include <unistd.h>
+
+// Client for a remote rtl_tcp server. Like the other read-based sources it
+// receives straight into the space the producer reserves in its ring (see
+// IQSource::BufferProvider). The ring is mirrored, so the free space is
+// always contiguous and a plain recv() fills it, no readv() needed.
+class TcpSource : public IQSource {
+public:
+  TcpSource(const std::string &host, uint16_t port = rtl_tcp::DEFAULT_PORT)
+      : host(host), port(port) {}
+
+  ~TcpSource() override {
+    if (sock >= 0) {
+      ::close(sock);
+    }
+  }
+
+  TcpSource(const TcpSource &) = delete;
+  TcpSource &operator=(const TcpSource &) = delete;
+
+  void open() override {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    addrinfo *result = nullptr;
+    std::string port_str = std::to_string(port);
+    if (getaddrinfo(host.c_str(), port_str.c_str(), &hints, &result) != 0) {
+      throw std::runtime_error("Failed to resolve " + host);
+    }
+
+    for (addrinfo *ai = result; ai; ai = ai->ai_next) {
+      sock = ::socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+      if (sock < 0)
+        continue;
+
+      // Must be set before connect for the window scaling to take effect
+      int rcvbuf = SOCKET_BUF_SIZE;
+      setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+
+      if (::connect(sock, ai->ai_addr, ai->ai_addrlen) == 0)
+        break;
+
+      ::close(sock);
+      sock = -1;
+    }
+    freeaddrinfo(result);
+
+    if (sock < 0) {
+      throw std::runtime_error("Failed to connect to " + host + ":" +
+                               port_str);
+    }
+
+    // Commands are tiny, don't let Nagle hold them back
+    int one = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // Wake up regularly so stop() (Receiver::join()) is noticed even if the
+    // server goes quiet
+    timeval timeout{0, 100000};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    uint8_t header[rtl_tcp::HEADER_SIZE];
+    if (read_exact(header, sizeof(header)) != sizeof(header) ||
+        !rtl_tcp::parse_header(header, info)) {
+      throw std::runtime_error("Not an rtl_tcp server: " + host);
+    }
+
+    std::cout << "Connected to rtl_tcp at " << host << ":" << port
+              << " (tuner type " << info.tuner_type << ", "
+              << info.gain_count << " gains)\n";
+  }
+
+  bool live() const override { return true; }
+
+  void configure(int sample_rate, int frequency, int gain_db) override {
+    send_command(rtl_tcp::SET_SAMPLE_RATE, sample_rate);
+    send_command(rtl_tcp::SET_GAIN_MODE, 1);
+    send_command(rtl_tcp::SET_GAIN, gain_db * 10);
+    send_command(rtl_tcp::SET_FREQUENCY, frequency);
+  }
+
+  bool retune(int frequency) override {
+    return send_command(rtl_tcp::SET_FREQUENCY, frequency);
+  }
+
+  bool set_gain(int gain_db) override {
+    return send_command(rtl_tcp::SET_GAIN, gain_db * 10);
+  }
+
+  bool set_sample_rate(int sample_rate) override {
+    return send_command(rtl_tcp::SET_SAMPLE_RATE, sample_rate);
+  }
+
+  std::size_t read(uint8_t *dest, std::size_t max_size) override {
+    return read_exact(dest, max_size);
+  }
+
+  // Like IQSource::stream(), but a block is handed out as soon as at least
+  // MIN_BLOCK bytes have arrived instead of after a whole BLOCK_SIZE, so a
+  // slow network doesn't hold back the audio
+  void stream(const BlockCallback &callback) override {
+    StreamBuffer buffer(BLOCK_SIZE);
+
+    while (!stop_requested) {
+      std::size_t len = BLOCK_SIZE;
+      uint8_t *dest = buffer_provider ? buffer_provider(len) : nullptr;
+      if (!dest) {
+        dest = buffer.data();
+        len = BLOCK_SIZE;
+      }
+
+      std::size_t bytes_read = read_some(dest, len);
+      if (bytes_read == 0) {
+        break;
+      }
+      // TCP has no block boundaries, so nothing is ever short
+      callback(make_block(dest, bytes_read, bytes_read));
+    }
+  }
+
+private:
+  // Reads at most len bytes, and never half an IQ pair: TCP can split one,
+  // and the dangling I would shift every pair after it. Waits for at least
+  // MIN_BLOCK bytes so the consumers don't get flooded with tiny blocks,
+  // unless the server pauses for a receive timeout, the stream ends or
+  // stop() is called.
+  std::size_t read_some(uint8_t *dest, std::size_t len) {
+    std::size_t min_len = std::min(MIN_BLOCK, len);
+    std::size_t bytes_read = 0;
+    if (has_carry) {
+      dest[bytes_read++] = carry;
+      has_carry = false;
+    }
+
+    while ((bytes_read < min_len || bytes_read % 2 != 0) && !stop_requested) {
+      ssize_t r = ::recv(sock, dest + bytes_read, len - bytes_read, 0);
+      if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) &&
+          bytes_read > 1) {
+        // The I of a split pair waits for its Q in the next block
+        if (bytes_read % 2 != 0) {
+          carry = dest[--bytes_read];
+          has_carry = true;
+        }
+        break;
+      }
+      if (r < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+          continue;
+        throw std::runtime_error("Error reading from rtl_tcp server");
+      }
+      if (r == 0) {
+        std::cerr << "rtl_tcp server closed the connection\n";
+        stop_requested = true;
+        break;
+      }
+      bytes_read += static_cast<std::size_t>(r);
+    }
+    return bytes_read;
+  }
+
+  std::size_t read_exact(uint8_t *dest, std::size_t len) {
+    std::size_t bytes_read = 0;
+
+    while (bytes_read < len && !stop_requested) {
+      ssize_t r = ::recv(sock, dest + bytes_read, len - bytes_read, 0);
+      if (r < 0) {
+        if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)
+          continue;
+        throw std::runtime_error("Error reading from rtl_tcp server");
+      }
+      if (r == 0)
+        break;
+      bytes_read += static_cast<std::size_t>(r);
+    }
+    return bytes_read;
+  }
+
+  bool send_command(uint8_t cmd, uint32_t param) {
+    uint8_t buf[rtl_tcp::COMMAND_SIZE];
+    rtl_tcp::encode_command(cmd, param, buf);
+    if (::send(sock, buf, sizeof(buf), MSG_NOSIGNAL) !=
+        static_cast<ssize_t>(sizeof(buf))) {
+      std::cerr << "Warning: Failed to send rtl_tcp command " << int(cmd)
+                << "\n";
+      return false;
+    }
+    return true;
+  }
+
+  static constexpr int SOCKET_BUF_SIZE = 4 << 20;
+  static constexpr std::size_t MIN_BLOCK = 16384;
+
+  std::string host;
+  uint16_t port;
+  int sock = -1;
+  rtl_tcp::DongleInfo info{};
+  // Half an IQ pair left over by read_some()
+  uint8_t carry = 0;
+  bool has_carry = false;
+};
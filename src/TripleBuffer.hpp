@@ -0,0 +1,65 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+
+// Hands the newest value of something from one writer thread to one reader
+// thread: a spectrum frame, a set of UI settings... Unlike a queue nothing
+// piles up. The reader always gets the latest value that was completely
+// written, values it never got to are simply replaced.
+//
+// There are three slots: the writer owns one (back), the reader owns one
+// (front) and the third one is in between. publish() and update() each
+// swap their slot with the one in between in a single atomic exchange, so
+// neither side ever waits for the other or sees a half-written value.
+template <typename T> class TripleBuffer {
+public:
+  explicit TripleBuffer(const T &initial = T())
+      : slots{initial, initial, initial} {}
+
+  TripleBuffer(const TripleBuffer &) = delete;
+  TripleBuffer &operator=(const TripleBuffer &) = delete;
+
+  // Writer: the slot to fill in place. It holds an older value (or the
+  // initial one), so keeping its allocations around is free, but
+  // everything has to be written before publish().
+  T &write_buffer() { return slots[back]; }
+
+  // Writer: makes write_buffer() the newest value
+  void publish() {
+    // Release our writes, and acquire the reader's last use of the slot we
+    // get back
+    back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+  }
+
+  void write(const T &value) {
+    write_buffer() = value;
+    publish();
+  }
+
+  // Reader: switches to the newest published value if there is a new one.
+  // Returns whether there was.
+  bool update() {
+    if (!(middle.load(std::memory_order_relaxed) & FRESH)) {
+      return false;
+    }
+    front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+    return true;
+  }
+
+  // Reader: the value update() last switched to, stays put until the next
+  // update()
+  const T &read() const { return slots[front]; }
+
+private:
+  static constexpr uint8_t INDEX = 3;
+  // Set in middle while it holds a value the reader hasn't taken yet
+  static constexpr uint8_t FRESH = 4;
+
+  T slots[3];
+  // Writer only
+  alignas(64) uint8_t back = 0;
+  alignas(64) std::atomic<uint8_t> middle{1};
+  // Reader only
+  alignas(64) uint8_t front = 2;
+};
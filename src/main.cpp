@@ -1,6 +1,17 @@
 #include "../include/miniaudio.h"
+#include "AudioProcessor.hpp"
+#include "FileSource.hpp"
 #include "GUIWindow.hpp"
-#include "SPSCQueue.hpp"
+#include "IQSource.hpp"
+#include "MmapSource.hpp"
+#include "Receiver.hpp"
+#include "RtlTcpServer.hpp"
+#include "SdrDevice.hpp"
+#include "SigMFRecorder.hpp"
+#include "Simd.hpp"
+#include "StreamBuffer.hpp"
+#include "TcpSource.hpp"
+#include "TripleBuffer.hpp"
 #include <algorithm>
 #include <atomic>
 #include <cassert>
@@ -9,15 +20,17 @@
 // Include complex before fftw3 makes it use the complex type instead of
 // defining it's own. (TODO: This doesn't seem to work)
 #include <complex>
+#include <csignal>
 #include <cstddef>
 #include <cstdint>
 #include <cstdlib>
-#include <cstring>
 #include <exception>
 #include <fftw3.h>
 #include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
-#include <rtl-sdr.h>
+#include <memory>
 #include <stdexcept>
 #include <string>
 #include <thread>
@@ -27,196 +40,26 @@
 // Global flag to stop execution of threads
 std::atomic<bool> running(true);
 
-static constexpr int TARGET_AUDIO_RATE = 48000;
-static constexpr int FFT_N = 1024;
-
-class SdrDevice {
-public:
-  SdrDevice(int index = 0) {
-    if (rtlsdr_open(&dev, index) != 0) {
-      throw std::runtime_error("Failed to open RTL-SDR device.");
-    }
-    std::cout << "Device opened successfully.\n";
-  }
-
-  ~SdrDevice() {
-    if (dev) {
-      rtlsdr_close(dev);
-      std::cout << "Device closed safely.\n";
-    }
-  }
-
-  // Disabling copy constructors to avoid double-free
-  SdrDevice(const SdrDevice &) = delete;
-  SdrDevice &operator=(const SdrDevice &) = delete;
-
-  void configure(int sample_rate, int frequency, int gain_db) {
-    int r;
-    std::cout << "Configuring SDR...\n";
-
-    r = rtlsdr_set_sample_rate(dev, sample_rate);
-    if (r < 0)
-      throw std::runtime_error("Failed to set sample rate");
-
-    // Give PLL time to lock
-    std::this_thread::sleep_for(std::chrono::milliseconds(50));
-
-    r = rtlsdr_set_tuner_gain_mode(dev, 1);
-    if (r < 0)
-      throw std::runtime_error("Failed to enable manual gain");
-
-    r = rtlsdr_set_tuner_gain(dev, gain_db * 10);
-    if (r < 0)
-      std::cerr << "Warning: Failed to set tuner gain.\n";
-
-    r = rtlsdr_set_center_freq(dev, frequency);
-    if (r < 0)
-      throw std::runtime_error("Failed to set frequency");
-
-    r = rtlsdr_reset_buffer(dev);
-    if (r < 0)
-      throw std::runtime_error("Failed to reset buffer");
-
-    std::cout << "Configuration complete.\n";
-  }
-
-  void read_sync(std::vector<uint8_t> &buffer) {
-    int bytes_read = 0;
-    int result =
-        rtlsdr_read_sync(dev, buffer.data(), buffer.size(), &bytes_read);
-
-    if (result < 0) {
-      throw std::runtime_error("Error reading from device.\n");
-    }
-
-    if (bytes_read != static_cast<int>(buffer.size())) {
-      std::cerr << "Warning: Short read (" << bytes_read << "bytes)\n";
-    }
-  }
-
-public:
-  // DEFAULT_BUF_LENGTH in rtl_sdr.c source code
-  static constexpr int BUF_SIZE = 16 * 16384;
-
-private:
-  rtlsdr_dev_t *dev = nullptr;
-};
-
-class AudioProcessor {
-public:
-  AudioProcessor(int decimation_rate)
-      : decimation_counter(0), decimation_sum(0.0f),
-        decimation_rate(decimation_rate),
-        prev_sample(std::complex<float>(1.0f, 0.0f)),
-        previous_filtered_sample(0.0f) {
-
-    // Calculations of alpha based on:
-    // https://en.wikipedia.org/wiki/Low-pass_filter#Discrete-time_realization
-    // Which links to:
-    // https://en.wikipedia.org/wiki/Exponential_smoothing#Time_constant
-    // Giving us the formula used below.
-    // 50 micro seconds is the default time-constant in Europe:
-    // https://www.fmradiobroadcast.com/article/detail/fm-emphasis.html
-    const float time_constant = 50e-6f;
-    float dt = 1.0f / TARGET_AUDIO_RATE;
-    alpha = 1.0f - std::exp(-dt / time_constant);
-  }
-
-  std::vector<int16_t> process(const std::vector<uint8_t> &raw_iq) {
-    // IQ sampling gives us the factor 2.
-    // We accumulate decimation_rate samples and filter them to become 1
-    // Hence our output buffer is smaller than the input buffer by a factor of
-    // (2 * decimation_rate)
-    std::vector<int16_t> output_buffer;
-    output_buffer.reserve(raw_iq.size() / (2 * decimation_rate));
-
-    // Note i += 2 since we jump from I sample to I sample
-    for (size_t i = 0; i < raw_iq.size(); i += 2) {
-      // Convert uint8_t sample to float:
-      // https://k3xec.com/packrat-processing-iq/
-      float real = ((float)raw_iq[i] - 127.5f) / 127.5f;
-      float imag = ((float)raw_iq[i + 1] - 127.5f) / 127.5f;
-      std::complex<float> current_sample = std::complex<float>(real, imag);
-
-      // We only care about the change in phase from the previous sample.
-      // Hence, we can perform complex multiplication with the complex conjugate
-      // of the previous sample to create a new complex number who's phase is
-      // the difference between the current sample and the previous sample:
-      // r1 * e^(i*p1) * conj(r2 * e^(i*p2)) = r1 * e^(i*p1) * r2 * e^(-i*p2) =
-      // = r1 * r2 * e^(i(p1 - p2)). arctan is then used to extract this phase.
-      std::complex<float> delta_sample =
-          current_sample * std::conj(prev_sample);
-      float delta_phase = std::atan2(delta_sample.imag(), delta_sample.real());
-
-      // Remember the current sample
-      prev_sample = current_sample;
-
-      // Moving average filter update
-      decimation_sum += delta_phase;
-      decimation_counter++;
-
-      // If we have collected decimation_rate samples
-      if (decimation_counter == decimation_rate) {
-        // Calculate the average value
-        float audio_sample = decimation_sum / (float)decimation_rate;
-
-        // Reset decimation counters and sum
-        decimation_counter = 0;
-        decimation_sum = 0.0f;
-
-        // de-emphasis like in below:
-        // rtl_fm.c: void deemph_filter(struct demod_state *fm)
-        float filtered_sample = (alpha * audio_sample) +
-                                ((1.0f - alpha) * previous_filtered_sample);
-        previous_filtered_sample = filtered_sample;
-
-        // Amplify the filtered audio sample
-        float amplified_sample = filtered_sample * 16000.0f;
-        // Clamp values to prevent integer overflow when casting to int16
-        amplified_sample = std::clamp(amplified_sample, -32768.0f, 32767.0f);
-
-        // Append to our output buffer
-        output_buffer.push_back(static_cast<int16_t>(amplified_sample));
-      }
-    }
-
-    return output_buffer;
-  }
-
-private:
-  // Decimation moving average variables
-  int decimation_counter;
-  float decimation_sum;
-  int decimation_rate;
-  // Previous IQ sample
-  std::complex<float> prev_sample;
-  // Previous De-emphasised sample
-  float previous_filtered_sample;
-  // constant for de-emphasis in europe
-  float alpha;
-};
-
-void producer_thread(SdrDevice &sdr, SPSCQueue &audio_queue,
-                     SPSCQueue &gui_queue) {
-  std::vector<uint8_t> buffer(SdrDevice::BUF_SIZE);
-
-  while (running) {
-    sdr.read_sync(buffer);
-
-    while (running && !audio_queue.push(buffer)) {
-      // Naive busy wait
-      // Sleep to make it less naive
-      std::this_thread::sleep_for(std::chrono::microseconds(100));
-    }
-
-    gui_queue.push(buffer);
-  }
-}
-
-void FFT_init(fftwf_complex *&in, fftwf_complex *&out, fftwf_plan *p) {
-  // Malloc memory for in/out buffers
-  in = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * FFT_N);
-  out = (fftwf_complex *)fftwf_malloc(sizeof(fftwf_complex) * FFT_N);
+static constexpr int FFT_N = SpectrumFrame::BINS;
+// ~60 spectrum frames per second
+static constexpr std::chrono::milliseconds SPECTRUM_INTERVAL{16};
+// Arrow keys in the GUI
+static constexpr int TUNE_STEP_HZ = 100000;
+static constexpr int GAIN_STEP_DB = 1;
+// Page up/down step through these. All are whole multiples of the audio
+// rate, and every demodulator has them planned before the audio starts.
+static constexpr int SAMPLE_RATES[] = {960000,  1152000, 1536000, 1920000,
+                                       2400000, 2880000, 3072000};
+// Above this the demodulator's decimation split is worth a warning, the
+// SAMPLE_RATES all demodulate at 336 kHz or less
+static constexpr int MAX_IF_RATE = 480000;
+
+void FFT_init(StreamBuffer &memory, fftwf_complex *&in, fftwf_complex *&out,
+              fftwf_plan *p) {
+  // in/out buffers, page aligned which is more than FFTW's SIMD needs
+  memory = StreamBuffer(2 * sizeof(fftwf_complex) * FFT_N);
+  in = reinterpret_cast<fftwf_complex *>(memory.data());
+  out = in + FFT_N;
 
   // Create FFT plan
   // "In short, if your program performs many transforms of the same size
@@ -225,11 +68,10 @@ void FFT_init(fftwf_complex *&in, fftwf_complex *&out, fftwf_plan *p) {
   *p = fftwf_plan_dft_1d(FFT_N, in, out, FFTW_FORWARD, FFTW_MEASURE);
 }
 
-void FFT_deinit(fftwf_complex *&in, fftwf_complex *&out, fftwf_plan *p) {
+void FFT_deinit(StreamBuffer &memory, fftwf_plan *p) {
   fftwf_destroy_plan(*p);
 
-  fftwf_free(in);
-  fftwf_free(out);
+  memory = StreamBuffer();
 }
 
 void FFT_helper(const std::vector<uint8_t> &raw_iq, fftwf_complex *in,
@@ -269,43 +111,307 @@ void FFT_helper(const std::vector<uint8_t> &raw_iq, fftwf_complex *in,
   std::rotate(magnitudes.begin(), middle, magnitudes.end());
 }
 
-void gui_thread_func(SPSCQueue &gui_queue, ma_device *MA, int sample_rate,
-                     int center_freq) {
+// Only used by the SIGUSR1 handler
+static std::vector<SigMFRecorder *> trigger_recorders;
+
+void trigger_signal_handler(int) {
+  for (SigMFRecorder *recorder : trigger_recorders) {
+    recorder->trigger();
+  }
+}
+
+using ReceiverList = std::vector<std::unique_ptr<Receiver>>;
+
+// What the GUI tells the audio callback, the newest value wins
+struct AudioParams {
+  float volume = 1.0f;
+  // Receiver whose audio is played
+  size_t selected = 0;
+};
+
+// Turns the newest samples of every receiver into a spectrum frame for the
+// GUI, at about the GUI's frame rate but independent of it. Also runs the
+// power squelch, so receivers that aren't shown trigger their recorders
+// too. allocated is set once the FFT buffers exist.
+void spectrum_thread_func(ReceiverList &receivers, float trigger_level_db,
+                          std::promise<void> &allocated) {
+  StreamBuffer fft_memory;
   fftwf_complex *in = nullptr;
   fftwf_complex *out = nullptr;
   fftwf_plan p;
-  FFT_init(in, out, &p);
+  FFT_init(fft_memory, in, out, &p);
+  allocated.set_value();
 
-  GUIWindow window(1024, 600, "Aether SDR", sample_rate, center_freq);
+  while (running) {
+    for (auto &rx : receivers) {
+      SpectrumFrame &frame = rx->spectrum.write_buffer();
+      // To get FFT_N complex samples we need 2 * FFT_N IQ samples
+      size_t bytes_read = rx->pop_gui(frame.iq.data(), frame.iq.size());
+      // We can only compute FFT if we received the necessary number of
+      // samples
+      if (bytes_read != frame.iq.size()) {
+        continue;
+      }
+      FFT_helper(frame.iq, in, out, frame.magnitudes, &p);
+      frame.iq_len = bytes_read;
+      rx->spectrum.publish();
+
+      // Power squelch: any bin above the level keeps the recording going
+      if (rx->recorder &&
+          *std::max_element(frame.magnitudes.begin(),
+                            frame.magnitudes.end()) > trigger_level_db) {
+        rx->recorder->trigger();
+      }
+    }
+    std::this_thread::sleep_for(SPECTRUM_INTERVAL);
+  }
 
-  float volume = 1.0f;
-  float prev_volume = volume;
-  ma_device_set_master_volume(MA, volume);
+  FFT_deinit(fft_memory, &p);
+}
 
-  // To get FFT_N complex samples we need 2 * FFT_N IQ samples
-  std::vector<uint8_t> rawIQ_buffer(2 * FFT_N);
-  // Magnitude of FFT in dB
-  std::vector<float> magnitudes(FFT_N);
+// The next rate in SAMPLE_RATES above (step 1) or below (step -1) rate,
+// rate itself at either end
+static int next_sample_rate(int rate, int step) {
+  int next = rate;
+  for (int candidate : SAMPLE_RATES) {
+    if (step > 0 && candidate > rate) {
+      return candidate;
+    }
+    if (step < 0 && candidate < rate) {
+      next = candidate;
+    }
+  }
+  return next;
+}
+
+void gui_thread_func(ReceiverList &receivers,
+                     TripleBuffer<AudioParams> &audio_params) {
+  using clock = std::chrono::steady_clock;
+
+  AudioParams params;
+  Receiver *rx = receivers[params.selected].get();
+  GUIWindow window(1024, 600, "Aether SDR", rx->sample_rate, rx->frequency);
+
+  auto last_status = clock::now();
+  uint64_t last_bytes = rx->stats.bytes.load(std::memory_order_relaxed);
+  uint32_t seen_tuning = rx->tuning();
 
   while (running && !window.should_close()) {
-    size_t bytes_read = gui_queue.pop(rawIQ_buffer.data(), rawIQ_buffer.size());
-    // We can only compute FFT if we received the necessary number of samples
-    if (bytes_read == rawIQ_buffer.size()) {
-      FFT_helper(rawIQ_buffer, in, out, magnitudes, &p);
+    // Number keys switch between receivers
+    int key = window.receiver_key_pressed();
+    if (key >= 0 && static_cast<size_t>(key) < receivers.size()) {
+      params.selected = key;
+      audio_params.write(params);
+      rx = receivers[key].get();
+      window.set_tuning(rx->sample_rate, rx->frequency);
+      last_bytes = rx->stats.bytes.load(std::memory_order_relaxed);
+      seen_tuning = rx->tuning();
+    }
+
+    // Arrow keys post requests, the producer applies them between blocks
+    int tune_step = window.tune_key_pressed();
+    if (tune_step != 0) {
+      rx->control.set_frequency(rx->frequency + tune_step * TUNE_STEP_HZ);
+    }
+    int gain_step = window.gain_key_pressed();
+    if (gain_step != 0) {
+      rx->control.set_gain(rx->gain_db + gain_step * GAIN_STEP_DB);
+    }
+    int rate_step = window.rate_key_pressed();
+    int rate = next_sample_rate(rx->sample_rate, rate_step);
+    if (rate != rx->sample_rate) {
+      rx->control.set_sample_rate(rate);
     }
-    window.draw(rawIQ_buffer, magnitudes, bytes_read, &volume);
 
-    // If volume has changed
-    if (volume != prev_volume) {
-      ma_device_set_master_volume(MA, volume);
-      prev_volume = volume;
+    if (rx->tuning() != seen_tuning) {
+      seen_tuning = rx->tuning();
+      window.set_tuning(rx->sample_rate, rx->frequency);
+    }
+
+    if (rx->recorder && window.trigger_pressed()) {
+      rx->recorder->trigger();
+    }
+    window.set_recording(rx->recorder && rx->recorder->active());
+
+    // Refresh the throughput shown in the title bar once a second
+    auto now = clock::now();
+    if (now - last_status >= std::chrono::seconds(1)) {
+      uint64_t bytes = rx->stats.bytes.load(std::memory_order_relaxed);
+      double seconds = std::chrono::duration<double>(now - last_status).count();
+      window.set_status(TextFormat(
+          "[%zu/%zu] %s  %.2f Msps  lost %llu", params.selected + 1,
+          receivers.size(), rx->label.c_str(),
+          (bytes - last_bytes) / 2.0 / seconds / 1e6,
+          static_cast<unsigned long long>(
+              rx->stats.samples_lost.load(std::memory_order_relaxed))));
+      last_bytes = bytes;
+      last_status = now;
+    }
+
+    // The newest frame the spectrum thread finished, if none is new we
+    // draw the last one again
+    rx->spectrum.update();
+    const SpectrumFrame &frame = rx->spectrum.read();
+    float volume = params.volume;
+    window.draw(frame.iq, frame.magnitudes, frame.iq_len, &volume);
+
+    if (volume != params.volume) {
+      params.volume = volume;
+      audio_params.write(params);
     }
   }
 
   // Terminate all other threads if window is closed
   running = false;
+}
 
-  FFT_deinit(in, out, &p);
+// One indented line of queue counters for the stats output
+static void print_queue(const char *name, const QueueTelemetry &t,
+                        const char *unit) {
+  auto percent = [&](std::size_t n) { return 100 * n / t.capacity; };
+  std::cout << "    " << name << ": " << percent(t.fill) << "% full (low "
+            << percent(t.low_water) << "%, high " << percent(t.high_water)
+            << "%), " << t.full_waits << " full waits for "
+            << std::chrono::duration<double, std::milli>(t.full_wait_time)
+                   .count()
+            << " ms, " << t.empty_pops << " empty reads, " << t.dropped << " "
+            << unit << " dropped\n";
+}
+
+// What the stream buffers got of what -H and -L asked for
+static void print_stream_memory() {
+  StreamBuffer::Report r = StreamBuffer::report();
+  auto mib = [](uint64_t bytes) { return bytes / (1024.0 * 1024.0); };
+  std::cout << std::fixed << std::setprecision(1)
+            << "Stream memory: " << mib(r.huge_bytes) << " MiB on huge pages, "
+            << mib(r.transparent_bytes)
+            << " MiB advised for transparent huge pages, "
+            << mib(r.normal_bytes) << " MiB on normal pages";
+  if (StreamBuffer::options().lock) {
+    std::cout << ", " << mib(r.locked_bytes) << " MiB locked";
+    if (r.lock_failures > 0) {
+      std::cout << " (" << r.lock_failures << " buffers could not be)";
+    }
+  }
+  std::cout << std::defaultfloat << "\n";
+}
+
+// Prints throughput and drop counters of every receiver once per interval,
+// followed by the state of its queues
+void stats_thread_func(ReceiverList &receivers, int interval_s) {
+  using clock = std::chrono::steady_clock;
+
+  std::vector<uint64_t> last_bytes(receivers.size(), 0);
+  auto last = clock::now();
+
+  while (running) {
+    // Sleep in small steps so we notice running going false
+    auto next = last + std::chrono::seconds(interval_s);
+    while (running && clock::now() < next) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    }
+
+    auto now = clock::now();
+    double seconds = std::chrono::duration<double>(now - last).count();
+    last = now;
+
+    for (size_t i = 0; i < receivers.size(); i++) {
+      Receiver &rx = *receivers[i];
+      uint64_t bytes = rx.stats.bytes.load(std::memory_order_relaxed);
+
+      std::cout << "[" << rx.label << "] "
+                << (bytes - last_bytes[i]) / 2.0 / seconds / 1e6 << " Msps, "
+                << rx.stats.blocks.load(std::memory_order_relaxed)
+                << " blocks, "
+                << rx.stats.audio_stalls.load(std::memory_order_relaxed)
+                << " audio stalls, "
+                << rx.stats.ring_drops.load(std::memory_order_relaxed)
+                << " dropped on a full ring, "
+                << rx.stats.short_blocks.load(std::memory_order_relaxed)
+                << " short, "
+                << rx.stats.late_blocks.load(std::memory_order_relaxed)
+                << " late, "
+                << rx.stats.samples_lost.load(std::memory_order_relaxed)
+                << " samples lost in "
+                << rx.stats.loss_events.load(std::memory_order_relaxed)
+                << " gaps\n";
+      print_queue("audio ring", rx.audio_telemetry(), "bytes");
+      print_queue("GUI ring", rx.gui_telemetry(), "bytes");
+      if (rx.recorder) {
+        print_queue("recorder queue", rx.recorder->queue_telemetry(),
+                    "blocks");
+      }
+      if (rx.server) {
+        print_queue("rtl_tcp queue", rx.server->queue_telemetry(), "blocks");
+      }
+      if (rx.pool) {
+        std::cout << "    block pool: " << rx.pool->count() << " blocks, "
+                  << rx.stats.pool_dropped_bytes.load(
+                         std::memory_order_relaxed)
+                  << " bytes dropped while all were in use\n";
+      }
+
+      last_bytes[i] = bytes;
+    }
+  }
+}
+
+// Runs the DSP chain over the whole source as fast as possible without audio
+// or GUI and reports the throughput of each stage
+void run_benchmark(IQSource &source, AudioProcessor &AP, int sample_rate) {
+  using clock = std::chrono::steady_clock;
+
+  StreamBuffer fft_memory;
+  fftwf_complex *in = nullptr;
+  fftwf_complex *out = nullptr;
+  fftwf_plan p;
+  FFT_init(fft_memory, in, out, &p);
+
+  std::vector<uint8_t> buffer(IQSource::BLOCK_SIZE);
+  std::vector<uint8_t> fft_iq(2 * FFT_N);
+  std::vector<float> magnitudes(FFT_N);
+
+  size_t total_bytes = 0;
+  clock::duration audio_time{0};
+  clock::duration fft_time{0};
+
+  while (running) {
+    buffer.resize(IQSource::BLOCK_SIZE);
+    size_t bytes_read = source.read(buffer.data(), buffer.size());
+    if (bytes_read == 0) {
+      break;
+    }
+    buffer.resize(bytes_read);
+    total_bytes += bytes_read;
+
+    auto t0 = clock::now();
+    std::vector<int16_t> audio = AP.process(buffer);
+    auto t1 = clock::now();
+
+    for (size_t i = 0; i + fft_iq.size() <= bytes_read; i += fft_iq.size()) {
+      fft_iq.assign(buffer.begin() + i, buffer.begin() + i + fft_iq.size());
+      FFT_helper(fft_iq, in, out, magnitudes, &p);
+    }
+    auto t2 = clock::now();
+
+    audio_time += t1 - t0;
+    fft_time += t2 - t1;
+  }
+
+  FFT_deinit(fft_memory, &p);
+
+  double samples = total_bytes / 2.0;
+  auto report = [&](const char *name, clock::duration d) {
+    double seconds = std::chrono::duration<double>(d).count();
+    double msps = seconds > 0.0 ? samples / seconds / 1e6 : 0.0;
+    std::cout << name << ": " << seconds << " s, " << msps << " Msps ("
+              << msps * 1e6 / sample_rate << "x real time)\n";
+  };
+
+  std::cout << "Processed " << samples / 1e6 << " M samples\n";
+  std::cout << "Demodulator: " << AP.describe() << "\n";
+  report("AudioProcessor::process", audio_time);
+  report("FFT_helper", fft_time);
 }
 
 void print_help() {
@@ -314,44 +420,101 @@ void print_help() {
             << "Options:\n"
             << "  -h Show this help message\n"
             << "  -s <sample rate (MHz)> Set the sample rate\n"
-            << "  -f <frequency (MHz)> Set the frequency\n"
-            << "  -g <gain(dB)> Set the tuner gain\n";
+            << "  -f <frequency (MHz)> Set the frequency, repeat to give each\n"
+            << "     device (-D) its own\n"
+            << "  -g <gain(dB)> Set the tuner gain\n"
+            << "  -a Use asynchronous (callback based) USB reads\n"
+            << "  -D <index|serial> Open this dongle, repeat for several\n"
+            << "  -C <core> Pin a producer to a core, repeat in -D order\n"
+            << "  -v Print throughput, drop and queue counters every second\n"
+            << "  -r <file> Replay a raw .cu8 capture instead of a dongle\n"
+            << "  -u Replay as fast as possible instead of at the sample rate\n"
+            << "  -n <host[:port]> Stream from an rtl_tcp server\n"
+            << "  -l <port> Serve the IQ stream to rtl_tcp clients\n"
+            << "  -m Memory-map the replayed file instead of reading it\n"
+            << "  -o <seconds> Start replaying at this offset (with -m)\n"
+            << "  -w <base path> Record IQ to <base path>.sigmf-data/-meta\n"
+            << "  -p <seconds> Only record on a trigger (R key, SIGUSR1 or -t),\n"
+            << "     including this many seconds before it (with -w)\n"
+            << "  -d <seconds> Seconds to record after a trigger (default 10)\n"
+            << "  -t <dB> Trigger when the spectrum peaks above this level\n"
+            << "  -b Benchmark the DSP chain on the source and exit\n"
+            << "  -P Spin instead of sleeping when a queue is full (lower\n"
+            << "     latency, keeps the producer cores busy)\n"
+            << "  -x Use the exact (scalar std::atan2) FM discriminator\n"
+            << "     instead of the SIMD approximation\n"
+            << "  -F <fir|cic|halfband> Decimate IQ with a FIR chain\n"
+            << "     (default), an integer CIC and a compensation FIR (cheaper\n"
+            << "     on CPUs without SIMD) or halfbands for factors of 2\n"
+            << "     (faster at 1.152 to 1.92 Msps)\n"
+            << "  -H Put rings and buffers on 2 MiB huge pages when available\n"
+            << "  -L Lock rings and buffers in memory and fault them in up\n"
+            << "     front (needs a large enough ulimit -l)\n";
 }
 
 struct AudioContext {
-  AudioProcessor *AP;
-  SPSCQueue *queue;
-  int decimation_rate;
+  std::vector<Receiver *> receivers;
+  // Last Receiver::tuning() seen for every receiver
+  std::vector<uint32_t> tunings;
+  // Written by the GUI
+  TripleBuffer<AudioParams> params;
 
+  // Padding for underruns
   std::vector<uint8_t> buffer;
+  std::vector<int16_t> audio;
 };
 
 void data_callback(ma_device *pDevice, void *pOutput, const void *pInput,
                    ma_uint32 frameCount) {
   auto *ctx = static_cast<AudioContext *>(pDevice->pUserData);
 
-  // Number of audio_samples needed (frameCount) * raw radio samples to audio
-  // samples factor (decimation rate) * 2 (IQ sampling)
-  size_t bytes_to_read = frameCount * ctx->decimation_rate * 2;
+  // Every receiver runs its own demodulator so its queue keeps draining and
+  // its filter state stays warm, only the selected one is heard
+  ctx->params.update();
+  const AudioParams &params = ctx->params.read();
+  for (size_t i = 0; i < ctx->receivers.size(); i++) {
+    Receiver *rx = ctx->receivers[i];
+
+    // A retune makes the old filter state meaningless, and a new sample rate
+    // needs a new decimation rate. Its chain is already planned, nothing here
+    // designs filters or allocates.
+    uint32_t tuning = rx->tuning();
+    if (tuning != ctx->tunings[i]) {
+      ctx->tunings[i] = tuning;
+      rx->AP.reset(std::max(1, rx->sample_rate / TARGET_AUDIO_RATE));
+    }
 
-  ctx->buffer.resize(bytes_to_read);
+    // Number of audio_samples needed (frameCount) * raw radio samples to
+    // audio samples factor (decimation rate) * 2 (IQ sampling)
+    size_t bytes_to_read = frameCount * rx->AP.decimation() * 2;
+
+    // Demodulate the raw IQ straight out of the queue, in two pieces if it
+    // wraps around the end of the ring
+    BroadcastRing::ReadRegion iq = rx->peek_audio(bytes_to_read);
+    ctx->audio.clear();
+    rx->AP.process(iq.first, iq.first_len, ctx->audio);
+    rx->AP.process(iq.second, iq.second_len, ctx->audio);
+    rx->consume_audio(iq.size());
+
+    // Not enough samples, fill up with silence
+    if (iq.size() < bytes_to_read) {
+      ctx->buffer.assign(bytes_to_read - iq.size(), 127);
+      rx->AP.process(ctx->buffer.data(), ctx->buffer.size(), ctx->audio);
+    }
 
-  // Get raw IQ samples
-  size_t bytes_read = ctx->queue->pop(&ctx->buffer[0], bytes_to_read);
+    // These should match
+    assert(ctx->audio.size() == frameCount);
 
-  if (bytes_read < bytes_to_read) {
-    std::memset(&ctx->buffer[bytes_read], 127, bytes_to_read - bytes_read);
+    if (i == params.selected) {
+      // volume is at most 1, nothing can clip
+      int16_t *output_buffer = static_cast<int16_t *>(pOutput);
+      for (size_t j = 0; j < frameCount; j++) {
+        output_buffer[j] =
+            static_cast<int16_t>(ctx->audio[j] * params.volume);
+      }
+    }
   }
 
-  // Process the raw IQ to audio
-  std::vector<int16_t> audio = ctx->AP->process(ctx->buffer);
-
-  // These should match
-  assert(audio.size() == frameCount);
-
-  int16_t *output_buffer = static_cast<int16_t *>(pOutput);
-  std::memcpy(output_buffer, audio.data(), frameCount * sizeof(int16_t));
-
   // Remove unused warning from compiler
   (void)pInput;
 }
@@ -377,11 +540,32 @@ void init_miniaudio(ma_device *MA, ma_device_data_proc data_callback,
 int main(int argc, char *argv[]) {
   // Defaults
   int sample_rate = 1920000; // 1.92 MHz
-  int frequency = 98400000;  // 98.4 MHz
-  int gain_db = 35;          // 35 db
+  std::vector<int> frequencies;
+  int gain_db = 35; // 35 db
+  bool async_mode = false;
+  std::vector<std::string> devices;
+  std::vector<int> cores;
+  bool print_stats = false;
+  WaitStrategy wait_strategy = WaitStrategy::BLOCK;
+  std::string replay_path;
+  std::string tcp_address;
+  int server_port = 0;
+  bool paced = true;
+  bool benchmark = false;
+  bool use_mmap = false;
+  float replay_offset = 0.0f;
+  std::string record_path;
+  float pre_trigger_seconds = 0.0f;
+  float post_trigger_seconds = 10.0f;
+  // Never triggers by default
+  float trigger_level_db = INFINITY;
+  StreamBuffer::Options memory_options;
+  FmDiscriminator::Mode discriminator_mode = FmDiscriminator::Mode::FAST;
+  AudioProcessor::FrontEnd front_end = AudioProcessor::FrontEnd::FIR;
 
   int opt;
-  while ((opt = getopt(argc, argv, "hs:f:g:")) != -1) {
+  while ((opt = getopt(argc, argv,
+                       "hs:f:g:aD:C:vr:n:l:umo:w:p:d:t:bPxF:HL")) != -1) {
     switch (opt) {
     case 'h':
       print_help();
@@ -396,14 +580,92 @@ int main(int argc, char *argv[]) {
     case 'f':
       // Expect frequency in MHz
       // Add 0.5f to fix truncation
-      frequency = static_cast<int>(std::round(std::stof(optarg) * 1e6));
-      std::cout << "Set frequency to: " << frequency << " Hz\n";
+      frequencies.push_back(
+          static_cast<int>(std::round(std::stof(optarg) * 1e6)));
+      std::cout << "Set frequency to: " << frequencies.back() << " Hz\n";
       break;
     case 'g':
       // We expect integer gains
       gain_db = std::stoi(optarg);
       std::cout << "Set gain to: " << gain_db << " dB\n";
       break;
+    case 'a':
+      async_mode = true;
+      std::cout << "Using asynchronous reads\n";
+      break;
+    case 'D':
+      devices.push_back(optarg);
+      break;
+    case 'C':
+      cores.push_back(std::stoi(optarg));
+      break;
+    case 'v':
+      print_stats = true;
+      break;
+    case 'r':
+      replay_path = optarg;
+      break;
+    case 'n':
+      tcp_address = optarg;
+      break;
+    case 'l':
+      server_port = std::stoi(optarg);
+      break;
+    case 'u':
+      paced = false;
+      break;
+    case 'm':
+      use_mmap = true;
+      break;
+    case 'o':
+      replay_offset = std::stof(optarg);
+      break;
+    case 'w':
+      record_path = optarg;
+      break;
+    case 'p':
+      pre_trigger_seconds = std::stof(optarg);
+      break;
+    case 'd':
+      post_trigger_seconds = std::stof(optarg);
+      break;
+    case 't':
+      trigger_level_db = std::stof(optarg);
+      break;
+    case 'b':
+      benchmark = true;
+      break;
+    case 'P':
+      wait_strategy = WaitStrategy::SPIN_YIELD;
+      break;
+    case 'x':
+      discriminator_mode = FmDiscriminator::Mode::EXACT;
+      break;
+    case 'F':
+      if (std::string(optarg) == "cic") {
+        front_end = AudioProcessor::FrontEnd::CIC;
+        if (simd::WIDTH > 1) {
+          // bench/decimation with SSE2: FIR is as fast or faster everywhere
+          std::cerr << "Warning: The CIC front end is meant for CPUs without "
+                       "SIMD, with "
+                    << simd::NAME
+                    << " the FIR front end is usually faster (see "
+                       "bench/decimation)\n";
+        }
+      } else if (std::string(optarg) == "halfband") {
+        front_end = AudioProcessor::FrontEnd::HALFBAND;
+      } else if (std::string(optarg) != "fir") {
+        std::cerr << "Unknown front end: " << optarg << "\n";
+        print_help();
+        return 1;
+      }
+      break;
+    case 'H':
+      memory_options.huge_pages = true;
+      break;
+    case 'L':
+      memory_options.lock = true;
+      break;
     default:
       print_help();
       return 1;
@@ -423,27 +685,153 @@ int main(int argc, char *argv[]) {
               << " Hz\n";
   }
 
+  if (frequencies.empty()) {
+    frequencies.push_back(98400000); // 98.4 MHz
+  }
+
+  // Before anything allocates a ring
+  StreamBuffer::configure(memory_options);
+
   try {
-    SdrDevice sdr(0);
-    sdr.configure(sample_rate, frequency, gain_db);
+    // Benchmarks never want to wait for the wall clock
+    paced = paced && !benchmark;
+
+    // One receiver per dongle, or a single one for the other sources
+    ReceiverList receivers;
+    std::vector<rtl_tcp::DongleInfo> dongle_infos;
+
+    auto add_receiver = [&](const std::string &label,
+                            std::unique_ptr<IQSource> source) {
+      size_t i = receivers.size();
+      // Devices without a frequency of their own use the last one given
+      int frequency = frequencies[std::min(i, frequencies.size() - 1)];
+
+      source->open();
+      source->configure(sample_rate, frequency, gain_db);
+      receivers.push_back(std::make_unique<Receiver>(
+          label, std::move(source), sample_rate, frequency, gain_db,
+          decimation_rate));
+      receivers.back()->AP.set_discriminator(discriminator_mode);
+      receivers.back()->AP.set_front_end(front_end);
+    };
+
+    if (!replay_path.empty() && use_mmap) {
+      auto mmap_source = std::make_unique<MmapSource>(replay_path, paced);
+      mmap_source->seek(
+          static_cast<size_t>(std::round(replay_offset * sample_rate)));
+      add_receiver(replay_path, std::move(mmap_source));
+      dongle_infos.push_back({0, 0});
+    } else if (!replay_path.empty()) {
+      add_receiver(replay_path,
+                   std::make_unique<FileSource>(replay_path, paced));
+      dongle_infos.push_back({0, 0});
+    } else if (!tcp_address.empty()) {
+      std::string host = tcp_address;
+      uint16_t port = rtl_tcp::DEFAULT_PORT;
+      size_t colon = tcp_address.rfind(':');
+      if (colon != std::string::npos) {
+        host = tcp_address.substr(0, colon);
+        port = static_cast<uint16_t>(std::stoi(tcp_address.substr(colon + 1)));
+      }
+      add_receiver(tcp_address, std::make_unique<TcpSource>(host, port));
+      dongle_infos.push_back({0, 0});
+    } else {
+      if (devices.empty()) {
+        devices.push_back("0");
+      }
+      for (const std::string &device : devices) {
+        // All digits is an index, anything else a serial number
+        bool is_index = device.find_first_not_of("0123456789") ==
+                        std::string::npos;
+        int index =
+            is_index ? std::stoi(device) : SdrDevice::index_by_serial(device);
+
+        auto sdr = std::make_unique<SdrDevice>(index, async_mode);
+        SdrDevice *sdr_ptr = sdr.get();
+        add_receiver(device, std::move(sdr));
+        // rtl_tcp clients want to know the tuner
+        dongle_infos.push_back({sdr_ptr->tuner_type(), sdr_ptr->gain_count()});
+      }
+    }
+
+    // Every receiver runs at the same rate, one check will do
+    const AudioProcessor &AP = receivers[0]->AP;
+    if (AP.if_rate() > MAX_IF_RATE) {
+      std::cerr << "Warning: A decimation of " << decimation_rate
+                << " leaves no small factor for the audio stage, FM runs at "
+                << AP.if_rate() / 1000 << " kHz"
+                << (AP.if_rate() / TARGET_AUDIO_RATE == decimation_rate
+                        ? " without a channel filter"
+                        : "")
+                << " (" << AP.describe() << ").\n"
+                << "Sample rates from the PageUp/PageDown list, e.g. 1920000 "
+                   "or 2400000, demodulate at 192 to 336 kHz\n";
+    }
 
-    AudioProcessor AP(decimation_rate);
+    if (benchmark) {
+      Receiver &rx = *receivers[0];
+      run_benchmark(*rx.source, rx.AP, sample_rate);
+      return 0;
+    }
+
+    for (size_t i = 0; i < receivers.size(); i++) {
+      Receiver &rx = *receivers[i];
+
+      if (!record_path.empty()) {
+        // Every device records to its own file
+        std::string path = receivers.size() > 1
+                               ? record_path + "-" + rx.label
+                               : record_path;
+        rx.recorder = std::make_unique<SigMFRecorder>(
+            path, sample_rate, rx.frequency, gain_db, pre_trigger_seconds,
+            post_trigger_seconds);
+        rx.recorder->start();
+
+        if (rx.recorder->is_triggered_mode()) {
+          trigger_recorders.push_back(rx.recorder.get());
+        }
+      }
+
+      if (server_port > 0) {
+        // One port per device, counting up
+        rx.server = std::make_unique<RtlTcpServer>(server_port + i,
+                                                   dongle_infos[i]);
+        rx.server->start();
+      }
+    }
+
+    if (!trigger_recorders.empty()) {
+      std::signal(SIGUSR1, trigger_signal_handler);
+    }
+
+    // So a sample rate change doesn't plan filters on the audio thread
+    int max_decimation = decimation_rate;
+    for (auto &rx : receivers) {
+      for (int rate : SAMPLE_RATES) {
+        rx->AP.prepare(rate / TARGET_AUDIO_RATE);
+        max_decimation = std::max(max_decimation, rate / TARGET_AUDIO_RATE);
+      }
+    }
 
-    SPSCQueue audio_queue(1 << 20);
     AudioContext ctx;
-    ctx.AP = &AP;
-    ctx.queue = &audio_queue;
-    ctx.decimation_rate = decimation_rate;
 
-    size_t max_buffer_bytes = 16384 * decimation_rate * 2;
+    size_t max_buffer_bytes = 16384 * max_decimation * 2;
     ctx.buffer.reserve(max_buffer_bytes);
+    ctx.audio.reserve(16384);
 
-    SPSCQueue gui_queue(1 << 20);
+    std::cout << "Starting producer threads... \n";
 
-    std::cout << "Starting producer thread... \n";
+    for (size_t i = 0; i < receivers.size(); i++) {
+      receivers[i]->set_wait_strategy(wait_strategy);
+      ctx.receivers.push_back(receivers[i].get());
+      ctx.tunings.push_back(receivers[i]->tuning());
+      receivers[i]->start(running, i < cores.size() ? cores[i] : -1);
+    }
 
-    std::thread prod(producer_thread, std::ref(sdr), std::ref(audio_queue),
-                     std::ref(gui_queue));
+    std::thread stats;
+    if (print_stats) {
+      stats = std::thread(stats_thread_func, std::ref(receivers), 1);
+    }
 
     std::cout << "Buffering data... \n";
     std::this_thread::sleep_for(std::chrono::milliseconds(500));
@@ -452,8 +840,22 @@ int main(int argc, char *argv[]) {
     ma_device MA;
     init_miniaudio(&MA, data_callback, &ctx);
 
-    gui_thread_func(gui_queue, &MA, sample_rate, frequency);
-    prod.join();
+    std::promise<void> spectrum_allocated;
+    std::thread spectrum(spectrum_thread_func, std::ref(receivers),
+                         trigger_level_db, std::ref(spectrum_allocated));
+    // The FFT buffers are the last stream memory to be allocated
+    spectrum_allocated.get_future().wait();
+    if (memory_options.huge_pages || memory_options.lock) {
+      print_stream_memory();
+    }
+    gui_thread_func(receivers, ctx.params);
+    spectrum.join();
+    for (auto &rx : receivers) {
+      rx->join();
+    }
+    if (stats.joinable()) {
+      stats.join();
+    }
 
     ma_device_uninit(&MA);
   } catch (const std::exception &e) {
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <cstdio>
+#include <cstdlib>
+
+// Just enough of a test framework: CHECK() reports a failed condition with
+// its line and keeps going, finish() turns the count into the exit status
+// that make test looks at.
+
+static int failures = 0;
+
+#define CHECK(condition)                                                       \
+  do {                                                                         \
+    if (!(condition)) {                                                        \
+      std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__,    \
+                   #condition);                                                \
+      failures++;                                                              \
+    }                                                                          \
+  } while (false)
+
+static int finish(const char *name) {
+  if (failures > 0) {
+    std::printf("%s: %d checks failed\n", name, failures);
+    return EXIT_FAILURE;
+  }
+  std::printf("%s: OK\n", name);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,287 @@
+// The decimators against the textbook definition: every output of a
+// FirDecimator, HalfbandDecimator and CicDecimator compared with a naive
+// convolution, with the input fed in pieces of awkward sizes so the history
+// (and the halfband's even/odd split) has to carry across calls. Then the
+// whole AudioProcessor chain with each front end: pieces against one call,
+// and a 1 kHz FM tone has to come out clean.
+
+#include "AudioProcessor.hpp"
+#include "CicDecimator.hpp"
+#include "FirDecimator.hpp"
+#include "HalfbandDecimator.hpp"
+#include "check.hpp"
+#include <algorithm>
+#include <cmath>
+#include <complex>
+#include <cstddef>
+#include <cstdint>
+#include <random>
+#include <vector>
+
+using cfloat = std::complex<float>;
+
+static const std::size_t MAX_BLOCK = 512;
+// Odd and even, smaller and larger than the filters
+static const std::size_t PIECES[] = {1, 2, 3, 7, 64, 129, 255, 512, 5, 300};
+
+// Output m of a decimator is the filter's output after input
+// factor - 1 + m * factor, with nothing but zeros before the first input
+template <typename T>
+static std::vector<T> naive_decimate(const std::vector<float> &taps,
+                                     const std::vector<T> &x, int factor) {
+  std::vector<T> y;
+  for (std::size_t n = factor - 1; n < x.size(); n += factor) {
+    T sum{};
+    for (std::size_t k = 0; k < taps.size() && k <= n; k++) {
+      sum += taps[k] * x[n - k];
+    }
+    y.push_back(sum);
+  }
+  return y;
+}
+
+// Runs x through decimator in the pieces above, over and over
+template <typename Decimator, typename T>
+static std::vector<T> in_pieces(Decimator &decimator,
+                                const std::vector<T> &x) {
+  std::vector<T> y;
+  std::size_t done = 0;
+  for (std::size_t i = 0; done < x.size(); i++) {
+    std::size_t n = std::min(PIECES[i % std::size(PIECES)], x.size() - done);
+    std::size_t produced = decimator.process(x.data() + done, n);
+    y.insert(y.end(), decimator.output(), decimator.output() + produced);
+    done += n;
+  }
+  return y;
+}
+
+template <typename T>
+static bool close(const std::vector<T> &a, const std::vector<T> &b,
+                  double tolerance) {
+  if (a.size() != b.size()) {
+    return false;
+  }
+  for (std::size_t i = 0; i < a.size(); i++) {
+    if (std::abs(a[i] - b[i]) > tolerance) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static std::vector<cfloat> noise(std::size_t n, std::mt19937 &rng) {
+  std::uniform_real_distribution<float> uniform(-1.0f, 1.0f);
+  std::vector<cfloat> x(n);
+  for (cfloat &v : x) {
+    v = {uniform(rng), uniform(rng)};
+  }
+  return x;
+}
+
+static void test_fir(std::mt19937 &rng) {
+  for (int factor : {1, 2, 3, 5, 8}) {
+    std::vector<float> taps =
+        design_lowpass({0.3 / factor, 0.5 / factor, 60.0});
+    std::vector<cfloat> x = noise(5000, rng);
+
+    ComplexDecimator complex_decimator(factor, taps, MAX_BLOCK);
+    CHECK(close(in_pieces(complex_decimator, x),
+                naive_decimate(taps, x, factor), 1e-5));
+
+    std::vector<float> real(x.size());
+    std::transform(x.begin(), x.end(), real.begin(),
+                   [](cfloat v) { return v.real(); });
+    RealDecimator real_decimator(factor, taps, MAX_BLOCK);
+    CHECK(close(in_pieces(real_decimator, real),
+                naive_decimate(taps, real, factor), 1e-5));
+
+    // reset() forgets the history, same outputs again
+    complex_decimator.reset();
+    CHECK(close(in_pieces(complex_decimator, x),
+                naive_decimate(taps, x, factor), 1e-5));
+  }
+}
+
+static void test_halfband(std::mt19937 &rng) {
+  for (double passband : {0.05, 0.15, 0.2}) {
+    std::vector<float> taps = design_halfband(passband);
+    CHECK(taps.size() % 4 == 3);
+    // Zero on every other tap but the centre one, symmetric
+    std::size_t center = taps.size() / 2;
+    for (std::size_t k = 0; k < taps.size(); k++) {
+      std::size_t t = k > center ? k - center : center - k;
+      if (t != 0 && t % 2 == 0) {
+        CHECK(taps[k] == 0.0f);
+      }
+      CHECK(taps[k] == taps[taps.size() - 1 - k]);
+    }
+
+    std::vector<cfloat> x = noise(5001, rng);
+    HalfbandDecimator decimator(taps, MAX_BLOCK);
+    std::vector<cfloat> expected = naive_decimate(taps, x, 2);
+    CHECK(close(in_pieces(decimator, x), expected, 1e-5));
+
+    // One sample at a time is the worst case for the even/odd carry, and
+    // a cascaded stage sometimes gets nothing at all in between
+    decimator.reset();
+    std::vector<cfloat> y;
+    for (const cfloat &v : x) {
+      CHECK(decimator.process(&v, 0) == 0);
+      if (decimator.process(&v, 1) == 1) {
+        y.push_back(decimator.output()[0]);
+      }
+    }
+    CHECK(close(y, expected, 1e-5));
+  }
+}
+
+// Stages moving sums of factor samples at the input rate, picked at the
+// output times
+static std::vector<cfloat> naive_cic(const std::vector<uint8_t> &raw,
+                                     int factor, int stages) {
+  std::size_t n = raw.size() / 2;
+  std::vector<double> i(n), q(n);
+  for (std::size_t k = 0; k < n; k++) {
+    i[k] = 2.0 * raw[2 * k] - 255.0;
+    q[k] = 2.0 * raw[2 * k + 1] - 255.0;
+  }
+  for (int s = 0; s < stages; s++) {
+    for (std::vector<double> *x : {&i, &q}) {
+      std::vector<double> sum(n);
+      double running = 0.0;
+      for (std::size_t k = 0; k < n; k++) {
+        running += (*x)[k];
+        if (k >= static_cast<std::size_t>(factor)) {
+          running -= (*x)[k - factor];
+        }
+        sum[k] = running;
+      }
+      *x = sum;
+    }
+  }
+  double scale = 1.0 / (255.0 * std::pow(factor, stages));
+  std::vector<cfloat> y;
+  for (std::size_t k = factor - 1; k < n; k += factor) {
+    y.emplace_back(static_cast<float>(i[k] * scale),
+                   static_cast<float>(q[k] * scale));
+  }
+  return y;
+}
+
+static void test_cic(std::mt19937 &rng) {
+  for (int stages : {1, 3, 5, CicDecimator::MAX_STAGES}) {
+    for (int factor : {2, 5, 8, 16}) {
+      std::vector<uint8_t> raw(2 * 4001);
+      for (uint8_t &b : raw) {
+        b = static_cast<uint8_t>(rng());
+      }
+      CicDecimator decimator(factor, stages, MAX_BLOCK);
+
+      std::vector<cfloat> y;
+      std::size_t done = 0;
+      for (std::size_t i = 0; done < raw.size() / 2; i++) {
+        std::size_t n =
+            std::min(PIECES[i % std::size(PIECES)], raw.size() / 2 - done);
+        std::size_t produced = decimator.process(raw.data() + 2 * done, n);
+        y.insert(y.end(), decimator.output(), decimator.output() + produced);
+        done += n;
+      }
+      CHECK(close(y, naive_cic(raw, factor, stages), 1e-6));
+    }
+  }
+
+  // Full scale in, full scale out: the wrapping registers come out right
+  std::vector<uint8_t> full(2 * 1000, 255);
+  CicDecimator decimator(8, CicDecimator::MAX_STAGES, 1000);
+  std::size_t produced = decimator.process(full.data(), 1000);
+  CHECK(std::abs(decimator.output()[produced - 1] - cfloat(1.0f, 1.0f)) <
+        1e-6);
+}
+
+// An FM station with a 1 kHz tone at 75 kHz deviation, as raw IQ
+static std::vector<uint8_t> fm_tone(int sample_rate, double seconds) {
+  std::size_t n = static_cast<std::size_t>(seconds * sample_rate);
+  std::vector<uint8_t> raw(2 * n);
+  double phase = 0.0;
+  for (std::size_t k = 0; k < n; k++) {
+    double t = static_cast<double>(k) / sample_rate;
+    phase += 2.0 * M_PI * 75000.0 * std::sin(2.0 * M_PI * 1000.0 * t) /
+             sample_rate;
+    raw[2 * k] = static_cast<uint8_t>(std::lround(127.5 + 100 * std::cos(phase)));
+    raw[2 * k + 1] =
+        static_cast<uint8_t>(std::lround(127.5 + 100 * std::sin(phase)));
+  }
+  return raw;
+}
+
+// Power of audio left over after taking out the best fitting 1 kHz sine
+// and DC, relative to the sine's
+static double distortion(const std::vector<int16_t> &audio) {
+  // The last 0.1 s, a whole number of periods well after the filters
+  // settled
+  std::size_t n = TARGET_AUDIO_RATE / 10;
+  const int16_t *x = audio.data() + audio.size() - n;
+  double mean = 0.0;
+  for (std::size_t k = 0; k < n; k++) {
+    mean += x[k];
+  }
+  mean /= n;
+  double c = 0.0, s = 0.0;
+  for (std::size_t k = 0; k < n; k++) {
+    double w = 2.0 * M_PI * 1000.0 * k / TARGET_AUDIO_RATE;
+    c += (x[k] - mean) * std::cos(w);
+    s += (x[k] - mean) * std::sin(w);
+  }
+  c *= 2.0 / n;
+  s *= 2.0 / n;
+  double residual = 0.0;
+  for (std::size_t k = 0; k < n; k++) {
+    double w = 2.0 * M_PI * 1000.0 * k / TARGET_AUDIO_RATE;
+    double e = x[k] - mean - c * std::cos(w) - s * std::sin(w);
+    residual += e * e;
+  }
+  return residual / n / ((c * c + s * s) / 2.0);
+}
+
+static void test_audio_processor() {
+  using FrontEnd = AudioProcessor::FrontEnd;
+  for (FrontEnd front_end : {FrontEnd::FIR, FrontEnd::CIC, FrontEnd::HALFBAND}) {
+    for (int decimation : {20, 24, 32, 40, 50, 60, 64}) {
+      std::vector<uint8_t> raw = fm_tone(decimation * TARGET_AUDIO_RATE, 0.3);
+
+      AudioProcessor whole(decimation);
+      whole.set_front_end(front_end);
+      std::vector<int16_t> expected = whole.process(raw);
+      CHECK(expected.size() == raw.size() / (2 * decimation));
+      // -30 dB, the tone comes through the chain
+      CHECK(distortion(expected) < 1e-3);
+
+      // Pieces of odd numbers of pairs, across the CHUNK boundaries
+      AudioProcessor pieces(decimation);
+      pieces.set_front_end(front_end);
+      std::vector<int16_t> audio;
+      std::size_t done = 0;
+      for (std::size_t i = 0; done < raw.size(); i++) {
+        std::size_t len = std::min(2 * (PIECES[i % std::size(PIECES)] * 7),
+                                   raw.size() - done);
+        pieces.process(raw.data() + done, len, audio);
+        done += len;
+      }
+      CHECK(audio.size() == expected.size());
+      bool same = audio.size() == expected.size();
+      for (std::size_t k = 0; same && k < audio.size(); k++) {
+        same = std::abs(audio[k] - expected[k]) <= 1;
+      }
+      CHECK(same);
+    }
+  }
+}
+
+int main() {
+  std::mt19937 rng(1);
+  test_fir(rng);
+  test_halfband(rng);
+  test_cic(rng);
+  test_audio_processor();
+  return finish("decimators");
+}
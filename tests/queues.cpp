@@ -0,0 +1,285 @@
+// Invariants of the lock-free plumbing: SPSCQueue order and all-or-nothing
+// pushes across the wrap, with and without the mirrored mapping, discard()
+// and discard_until(), a two-thread stress run; BroadcastRing lossless
+// readers holding the writer back and lossy ones being skipped ahead by
+// exactly what they missed; BlockPool reference counts.
+
+#include "BlockPool.hpp"
+#include "BroadcastRing.hpp"
+#include "SPSCQueue.hpp"
+#include "check.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// Element k of a stream, so any reordering or loss shows
+static uint32_t value(std::size_t k) {
+  return static_cast<uint32_t>(k * 2654435761u);
+}
+
+template <bool CACHE_INDICES> static void test_spsc(bool mirrored) {
+  // A page of elements, the smallest a mirrored queue can be
+  const std::size_t size = 1024;
+  SPSCQueue<uint32_t, CACHE_INDICES> queue(size, mirrored);
+  CHECK(queue.capacity() == size);
+
+  std::size_t written = 0;
+  std::size_t read = 0;
+  std::vector<uint32_t> in;
+  std::vector<uint32_t> out;
+  // Odd sizes so the indices land everywhere relative to the wrap
+  for (std::size_t step : {1, 7, 300, 1000, 333, 1023, 5}) {
+    for (int round = 0; round < 5; round++) {
+      in.resize(step);
+      for (std::size_t k = 0; k < step; k++) {
+        in[k] = value(written + k);
+      }
+      CHECK(queue.push(in));
+      written += step;
+      CHECK(queue.size() == step);
+
+      // No room for another step on top, and nothing of it goes in
+      if (step > size / 2) {
+        CHECK(!queue.push(in));
+        CHECK(queue.size() == step);
+      }
+
+      CHECK(queue.pop(out, step));
+      CHECK(out.size() == step);
+      for (std::size_t k = 0; k < out.size(); k++) {
+        CHECK(out[k] == value(read + k));
+      }
+      read += out.size();
+      CHECK(queue.size() == 0);
+      CHECK(!queue.pop(out, 1));
+    }
+  }
+
+  // reserve() stops at the wrap unless the memory is mirrored
+  std::size_t index = queue.write_position() % size;
+  auto region = queue.reserve(size);
+  CHECK(region.size() == size);
+  CHECK(region.first_len == (queue.is_mirrored() ? size : size - index));
+  for (std::size_t k = 0; k < region.size(); k++) {
+    uint32_t v = value(written + k);
+    (k < region.first_len ? region.first[k]
+                          : region.second[k - region.first_len]) = v;
+  }
+  queue.commit(region.size());
+  written += region.size();
+  CHECK(queue.reserve(1).size() == 0);
+
+  // discard() drops the oldest, as many as there are
+  CHECK(queue.discard(10) == 10);
+  read += 10;
+  auto peeked = queue.peek(1);
+  CHECK(peeked.size() == 1 && peeked.first[0] == value(read));
+  CHECK(queue.read_position() == read);
+
+  // Past positions drop nothing, later ones no more than was written
+  CHECK(queue.discard_until(read - 5) == 0);
+  CHECK(queue.discard_until(read + 100) == 100);
+  read += 100;
+  CHECK(queue.discard_until(written + 1000) == written - read);
+  read = written;
+  CHECK(queue.size() == 0);
+  CHECK(queue.discard(1) == 0);
+  // The whole queue is free again
+  CHECK(queue.reserve(size).size() == size);
+}
+
+// Producer and consumer on two threads, random sizes both ways
+static void test_spsc_threads() {
+  const std::size_t total = 1 << 21;
+  SPSCQueue<uint32_t> queue(4096);
+  std::thread producer([&] {
+    std::vector<uint32_t> chunk;
+    for (std::size_t k = 0; k < total;) {
+      std::size_t n = std::min<std::size_t>(1 + value(k) % 700, total - k);
+      chunk.resize(n);
+      for (std::size_t j = 0; j < n; j++) {
+        chunk[j] = value(k + j);
+      }
+      while (!queue.push(chunk)) {
+        queue.wait_for_space(n, std::chrono::milliseconds(10));
+      }
+      k += n;
+    }
+  });
+
+  bool in_order = true;
+  std::vector<uint32_t> out(1000);
+  for (std::size_t k = 0; k < total;) {
+    std::size_t n = queue.pop(out.data(), 1 + value(k) % 1000);
+    if (n == 0) {
+      queue.wait_for_data(1, std::chrono::milliseconds(10));
+    }
+    for (std::size_t j = 0; j < n; j++) {
+      in_order = in_order && out[j] == value(k + j);
+    }
+    k += n;
+  }
+  producer.join();
+  CHECK(in_order);
+  CHECK(queue.size() == 0);
+}
+
+static void fill(std::vector<uint8_t> &bytes, std::size_t position) {
+  for (std::size_t k = 0; k < bytes.size(); k++) {
+    bytes[k] = static_cast<uint8_t>(value(position + k));
+  }
+}
+
+static bool matches(const uint8_t *bytes, std::size_t len,
+                    std::size_t position) {
+  for (std::size_t k = 0; k < len; k++) {
+    if (bytes[k] != static_cast<uint8_t>(value(position + k))) {
+      return false;
+    }
+  }
+  return true;
+}
+
+static void test_broadcast_ring() {
+  const std::size_t size = 1 << 16;
+  BroadcastRing ring(size);
+  auto lossless = ring.add_reader(BroadcastRing::LOSSLESS);
+  auto lossy = ring.add_reader(BroadcastRing::LOSSY);
+
+  // The lossless reader holds the writer back at a full ring
+  std::vector<uint8_t> block(4096);
+  std::size_t written = 0;
+  for (std::size_t k = 0; k < size / block.size(); k++) {
+    fill(block, written);
+    CHECK(ring.push(block.data(), block.size()));
+    written += block.size();
+  }
+  CHECK(!ring.push(block.data(), 1));
+  CHECK(ring.size(lossless) == size);
+
+  // In place reads for the lossless one
+  auto region = ring.peek(lossless, 1000);
+  CHECK(region.size() == 1000 && matches(region.first, 1000, 0));
+  ring.consume(lossless, 1000);
+
+  // Keep the lossless reader right behind the writer while it laps the
+  // lossy one a few times over
+  std::size_t lossless_read = 1000;
+  std::vector<uint8_t> out(size);
+  for (int k = 0; k < 100; k++) {
+    std::size_t len = 1000 + 2 * k;
+    std::size_t n = ring.pop(lossless, out.data(), len);
+    CHECK(n == len && matches(out.data(), n, lossless_read));
+    lossless_read += n;
+    block.resize(len);
+    fill(block, written);
+    CHECK(ring.push(block.data(), len));
+    written += len;
+  }
+
+  // All it gets is the newest ring's worth, and it's told about the rest
+  std::size_t n = ring.pop(lossy, out.data(), size);
+  CHECK(ring.missed(lossy) == written - size);
+  CHECK(n == size && matches(out.data(), n, written - size));
+  CHECK(ring.pop(lossy, out.data(), size) == 0);
+  // A lossless reader never misses anything
+  CHECK(ring.missed(lossless) == 0);
+
+  // Skipping to the latest isn't missing
+  std::size_t before = ring.size(lossless);
+  std::size_t skipped = ring.skip_to_latest(lossless, 100);
+  CHECK(skipped == ((before - 100) & ~std::size_t(1)));
+  CHECK(ring.size(lossless) == before - skipped);
+  CHECK(ring.missed(lossless) == 0);
+
+  // Up to a position and no further
+  std::size_t position = ring.write_position();
+  block.resize(64);
+  fill(block, written);
+  CHECK(ring.push(block.data(), block.size()));
+  written += block.size();
+  ring.discard_until(lossless, position);
+  CHECK(ring.size(lossless) == block.size());
+  CHECK(ring.pop(lossless, out.data(), size) == block.size());
+  CHECK(matches(out.data(), block.size(), written - block.size()));
+}
+
+// Only lossy readers: the writer never waits
+static void test_broadcast_ring_lossy_only() {
+  const std::size_t size = 1 << 16;
+  BroadcastRing ring(size);
+  auto reader = ring.add_reader(BroadcastRing::LOSSY);
+  std::vector<uint8_t> block(size / 2);
+  for (int k = 0; k < 10; k++) {
+    fill(block, k * block.size());
+    CHECK(ring.push(block.data(), block.size()));
+  }
+  std::vector<uint8_t> out(size);
+  std::size_t n = ring.pop(reader, out.data(), size);
+  CHECK(n == size && matches(out.data(), n, 10 * block.size() - size));
+  CHECK(ring.missed(reader) == 10 * block.size() - size);
+}
+
+static void test_block_pool() {
+  bool threw = false;
+  try {
+    BlockPool odd(4, 1000);
+  } catch (const std::invalid_argument &) {
+    threw = true;
+  }
+  CHECK(threw);
+
+  const std::size_t count = 4;
+  BlockPool pool(count, 4096);
+  std::vector<BlockRef> blocks;
+  for (std::size_t k = 0; k < count; k++) {
+    uint8_t *data = pool.acquire();
+    CHECK(data != nullptr);
+    data[0] = static_cast<uint8_t>(k);
+    BlockRef info{};
+    info.len = 4096;
+    info.sequence = k;
+    // Two consumers each
+    blocks.push_back(pool.publish(info, 2));
+    CHECK(blocks.back().data == data && blocks.back().sequence == k);
+  }
+  // Every block is referenced, and distinct
+  CHECK(pool.acquire() == nullptr);
+  for (std::size_t k = 0; k < count; k++) {
+    CHECK(blocks[k].data[0] == k);
+  }
+
+  // Free only once the last reference is gone
+  BlockPool::release(blocks[1]);
+  CHECK(pool.acquire() == nullptr);
+  BlockPool::retain(blocks[1], 2);
+  BlockPool::release(blocks[1]);
+  BlockPool::release(blocks[1]);
+  CHECK(pool.acquire() == nullptr);
+  BlockPool::release(blocks[1]);
+  CHECK(blocks[1].refs->load() == 0);
+  uint8_t *data = pool.acquire();
+  CHECK(data == blocks[1].data);
+  pool.publish(BlockRef{}, 1);
+  CHECK(pool.acquire() == nullptr);
+
+  // The scan goes on after the last block handed out, not from the start
+  for (std::size_t k : {0, 2, 3}) {
+    BlockPool::release(blocks[k]);
+    BlockPool::release(blocks[k]);
+  }
+  CHECK(pool.acquire() == blocks[2].data);
+}
+
+int main() {
+  test_spsc<true>(false);
+  test_spsc<true>(true);
+  test_spsc<false>(false);
+  test_spsc_threads();
+  test_broadcast_ring();
+  test_broadcast_ring_lossy_only();
+  test_block_pool();
+  return finish("queues");
+}
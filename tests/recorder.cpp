@@ -0,0 +1,261 @@
+// SigMFRecorder with a real BlockPool and files in a scratch directory: a
+// continuous recording has to come out byte for byte, the triggered one has
+// to hold no more than max_blocks() of the pool however fast it's fed, and
+// write the pre-trigger window plus what follows without a gap, and drop
+// rather than hold more when its writer is stuck. A trigger whose file
+// can't be opened leaves the recorder armed.
+
+#include "BlockPool.hpp"
+#include "IQSource.hpp"
+#include "SigMFRecorder.hpp"
+#include "check.hpp"
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static const std::size_t BLOCK = IQSource::BLOCK_SIZE;
+
+// Every block starts with its sequence number, the rest depends on it too
+static void fill_block(uint8_t *data, uint64_t sequence) {
+  std::memcpy(data, &sequence, sizeof(sequence));
+  for (std::size_t k = sizeof(sequence); k < BLOCK; k++) {
+    data[k] = static_cast<uint8_t>(sequence * 31 + k);
+  }
+}
+
+static bool is_block(const uint8_t *data, std::size_t len,
+                     uint64_t sequence) {
+  std::vector<uint8_t> expected(BLOCK);
+  fill_block(expected.data(), sequence);
+  return std::memcmp(data, expected.data(), len) == 0;
+}
+
+// The pool's reference counts, one per block that was handed out
+using Refs = std::set<std::atomic<uint32_t> *>;
+
+// Blocks of the pool that someone still holds on to
+static std::size_t held(const Refs &refs) {
+  std::size_t n = 0;
+  for (auto *r : refs) {
+    n += r->load() > 0;
+  }
+  return n;
+}
+
+// Hands the recorder the next block, false if the pool had none
+static bool push_block(BlockPool &pool, SigMFRecorder &recorder,
+                       uint64_t sequence, Refs &refs) {
+  uint8_t *data = pool.acquire();
+  if (!data) {
+    return false;
+  }
+  fill_block(data, sequence);
+  BlockRef info{};
+  info.len = BLOCK;
+  info.sequence = sequence;
+  info.first_sample = sequence * BLOCK / 2;
+  info.frequency = 100000000;
+  BlockRef block = pool.publish(info, 1);
+  refs.insert(block.refs);
+  recorder.push(block);
+  return true;
+}
+
+static std::vector<uint8_t> read_file(const std::string &path) {
+  std::ifstream file(path, std::ios::binary);
+  return {std::istreambuf_iterator<char>(file),
+          std::istreambuf_iterator<char>()};
+}
+
+static void test_continuous(const std::string &dir) {
+  const int rate = 1000000;
+  SigMFRecorder recorder(dir + "/continuous", rate, 100000000, 30);
+  BlockPool pool(recorder.max_blocks());
+  recorder.start();
+
+  Refs refs;
+  const uint64_t blocks = 40;
+  for (uint64_t k = 0; k < blocks;) {
+    if (push_block(pool, recorder, k, refs)) {
+      k++;
+    } else {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  }
+  recorder.stop();
+
+  std::vector<uint8_t> data = read_file(dir + "/continuous.sigmf-data");
+  CHECK(data.size() == blocks * BLOCK);
+  bool same = data.size() == blocks * BLOCK;
+  for (uint64_t k = 0; same && k < blocks; k++) {
+    same = is_block(data.data() + k * BLOCK, BLOCK, k);
+  }
+  CHECK(same);
+  CHECK(recorder.dropped() == 0);
+  // Everything handed back
+  CHECK(held(refs) == 0);
+
+  std::vector<uint8_t> meta = read_file(dir + "/continuous.sigmf-meta");
+  std::string text(meta.begin(), meta.end());
+  CHECK(text.find("\"core:sample_rate\": 1000000") != std::string::npos);
+  CHECK(text.find("\"aether:stop_datetime\"") != std::string::npos);
+}
+
+static void test_triggered(const std::string &dir) {
+  const int rate = 1000000;
+  // 4 blocks of window, 6 after the trigger
+  const float pre = 4.0f * BLOCK / 2 / rate;
+  const float post = 6.0f * BLOCK / 2 / rate;
+  SigMFRecorder recorder(dir + "/triggered", rate, 100000000, 30, pre, post);
+  // Plenty of pool, what the recorder holds on to is up to it
+  BlockPool pool(2 * recorder.max_blocks());
+  recorder.start();
+
+  // As fast as the pool goes, the recorder refuses what it has no budget
+  // for instead of holding more
+  Refs refs;
+  uint64_t sequence = 0;
+  bool within_budget = true;
+  for (std::size_t k = 0; k < 3 * recorder.max_blocks(); k++) {
+    if (push_block(pool, recorder, sequence, refs)) {
+      sequence++;
+    }
+    within_budget = within_budget && held(refs) <= recorder.max_blocks();
+  }
+  CHECK(within_budget);
+
+  // The writer trims to the window while nothing is triggered
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  CHECK(held(refs) >= 4 && held(refs) <= 5);
+  CHECK(!recorder.active());
+
+  // The window ends at the last block that got in, the trigger should
+  // carry on from there
+  std::size_t dropped = recorder.dropped();
+  recorder.trigger();
+  for (int k = 0; k < 20; k++) {
+    while (!push_block(pool, recorder, sequence, refs)) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    sequence++;
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+  }
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  CHECK(!recorder.active());
+  CHECK(recorder.dropped() == dropped);
+  recorder.stop();
+  CHECK(held(refs) == 0);
+
+  // The window (whole blocks, 4 or 5 of them) and then 6 blocks' worth
+  std::vector<uint8_t> data = read_file(dir + "/triggered-0001.sigmf-data");
+  std::size_t window = data.size() - 6 * BLOCK;
+  CHECK(window == 4 * BLOCK || window == 5 * BLOCK);
+  uint64_t first = 0;
+  std::memcpy(&first, data.data(), sizeof(first));
+  bool contiguous = data.size() % BLOCK == 0;
+  for (std::size_t k = 0; contiguous && k < data.size() / BLOCK; k++) {
+    contiguous = is_block(data.data() + k * BLOCK, BLOCK, first + k);
+  }
+  CHECK(contiguous);
+}
+
+// The triggered recording goes into a pipe nobody reads, so the writer
+// hangs on its first write. The producer keeps pushing: the recorder may
+// hold its max_blocks() and has to drop the rest, not take the pool.
+static void test_stalled_writer(const std::string &dir) {
+  const int rate = 1000000;
+  const float pre = 4.0f * BLOCK / 2 / rate;
+  std::string fifo = dir + "/stalled-0001.sigmf-data";
+  CHECK(mkfifo(fifo.c_str(), 0600) == 0);
+  // Opened before the recorder's end so neither open blocks
+  int reader = ::open(fifo.c_str(), O_RDONLY | O_NONBLOCK);
+  CHECK(reader >= 0);
+
+  SigMFRecorder recorder(dir + "/stalled", rate, 100000000, 30, pre, pre);
+  BlockPool pool(2 * recorder.max_blocks());
+  recorder.start();
+
+  Refs refs;
+  uint64_t sequence = 0;
+  for (; sequence < 4; sequence++) {
+    CHECK(push_block(pool, recorder, sequence, refs));
+  }
+  recorder.trigger();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  CHECK(recorder.active());
+
+  bool within_budget = true;
+  for (std::size_t k = 0; k < 2 * recorder.max_blocks(); k++) {
+    if (push_block(pool, recorder, sequence, refs)) {
+      sequence++;
+    }
+    within_budget = within_budget && held(refs) <= recorder.max_blocks();
+  }
+  CHECK(within_budget);
+  // A full queue, plus the block the writer was on if it had one
+  CHECK(held(refs) + 1 >= recorder.max_blocks());
+  CHECK(recorder.dropped() > 0);
+
+  // Drain the pipe so the writer can finish
+  fcntl(reader, F_SETFL, 0);
+  std::thread drain([reader] {
+    std::vector<uint8_t> buffer(1 << 16);
+    while (::read(reader, buffer.data(), buffer.size()) > 0) {
+    }
+  });
+  recorder.stop();
+  drain.join();
+  ::close(reader);
+  CHECK(held(refs) == 0);
+}
+
+static void test_trigger_open_fails(const std::string &dir) {
+  const int rate = 1000000;
+  const float pre = 2.0f * BLOCK / 2 / rate;
+  // Nothing can be created in a directory that doesn't exist
+  SigMFRecorder recorder(dir + "/missing/triggered", rate, 100000000, 30,
+                         pre, pre);
+  BlockPool pool(recorder.max_blocks());
+  recorder.start();
+
+  Refs refs;
+  for (uint64_t k = 0; k < 4; k++) {
+    CHECK(push_block(pool, recorder, k, refs));
+  }
+  recorder.trigger();
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  // Still here and still armed
+  CHECK(!recorder.active());
+  CHECK(push_block(pool, recorder, 4, refs));
+  recorder.stop();
+  CHECK(held(refs) == 0);
+}
+
+int main() {
+  char dir[] = "/tmp/aether-test-XXXXXX";
+  if (!mkdtemp(dir)) {
+    std::perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+  test_continuous(dir);
+  test_triggered(dir);
+  test_stalled_writer(dir);
+  test_trigger_open_fails(dir);
+
+  std::string cleanup = std::string("rm -rf ") + dir;
+  if (std::system(cleanup.c_str()) != 0) {
+    std::fprintf(stderr, "Could not remove %s\n", dir);
+  }
+  return finish("recorder");
+}
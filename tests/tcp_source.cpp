@@ -0,0 +1,87 @@
+// TcpSource against a local rtl_tcp server that sends the stream in odd
+// sized writes and pauses longer than the receive timeout right after an
+// I, so a block ends between the I and Q of a pair. Every block has to be
+// whole pairs and the stream has to come out unchanged.
+
+#include "RtlTcp.hpp"
+#include "TcpSource.hpp"
+#include "check.hpp"
+#include <arpa/inet.h>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+static uint8_t value(std::size_t k) {
+  return static_cast<uint8_t>(k * 7 + k / 251);
+}
+
+int main() {
+  int listener = ::socket(AF_INET, SOCK_STREAM, 0);
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t addr_len = sizeof(addr);
+  if (listener < 0 ||
+      ::bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) !=
+          0 ||
+      ::listen(listener, 1) != 0 ||
+      ::getsockname(listener, reinterpret_cast<sockaddr *>(&addr),
+                    &addr_len) != 0) {
+    std::perror("listen");
+    return EXIT_FAILURE;
+  }
+
+  const std::size_t total = 200000;
+  std::thread server([&] {
+    int client = ::accept(listener, nullptr, nullptr);
+    uint8_t header[rtl_tcp::HEADER_SIZE];
+    rtl_tcp::encode_header({5, 29}, header);
+    CHECK(::send(client, header, sizeof(header), MSG_NOSIGNAL) ==
+          static_cast<ssize_t>(sizeof(header)));
+
+    std::vector<uint8_t> stream(total);
+    for (std::size_t k = 0; k < total; k++) {
+      stream[k] = value(k);
+    }
+    // Odd writes, with a pause after a few of them that leaves an I
+    // without its Q
+    const std::size_t writes[] = {1, 4097, 333, 20001, 3, 70001};
+    std::size_t sent = 0;
+    for (std::size_t i = 0; sent < total; i++) {
+      std::size_t n = std::min(writes[i % std::size(writes)], total - sent);
+      CHECK(::send(client, stream.data() + sent, n, MSG_NOSIGNAL) ==
+            static_cast<ssize_t>(n));
+      sent += n;
+      if (i < 6 && sent % 2 != 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(150));
+      }
+    }
+    ::close(client);
+  });
+
+  TcpSource source("127.0.0.1", ntohs(addr.sin_port));
+  source.open();
+
+  std::vector<uint8_t> received;
+  bool whole_pairs = true;
+  source.stream([&](const IQBlock &block) {
+    whole_pairs = whole_pairs && block.len % 2 == 0;
+    received.insert(received.end(), block.data, block.data + block.len);
+  });
+  server.join();
+  ::close(listener);
+
+  CHECK(whole_pairs);
+  CHECK(received.size() == total);
+  bool same = received.size() == total;
+  for (std::size_t k = 0; same && k < total; k++) {
+    same = received[k] == value(k);
+  }
+  CHECK(same);
+  return finish("tcp_source");
+}